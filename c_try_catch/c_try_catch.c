@@ -1,42 +1,10 @@
 #include "c_try_catch.h"
 #include <stdlib.h>
 #include <stdio.h>
+#include <stdint.h>
 
 // --- data structure declarations ---
 
-// Registry for a catch block, must associate with a try block
-typedef struct HandlerRegistry_t {
-    // which type shall this catch block handle?
-    ExceptionType_t type_identifier;
-
-    // linked list
-    struct HandlerRegistry_t *next;
-} HandlerRegistry_t;
-
-// Registry for a try block
-typedef struct RegionRegistry_t {
-    // a value that identifies this try block, usually it is the address of associated register_try() func call
-    // it is unique regardless of nested try blocks
-    void *region_identifier;
-
-    // start & end address of this try block, obtained by label
-    void *try_start;
-    void *try_end;
-
-    // associated registered catch handlers, handlers must unique for each catch type
-    HandlerRegistry_t sentinel_handlers;
-
-    // entry point of associated catch blocks
-    jmp_buf *env;
-
-    // if accessed properly by get_exception_data(), this two fields store thrown exception info
-    ExceptionType_t type;
-    void *data;
-
-    // linked list
-    struct RegionRegistry_t *next;
-} RegionRegistry_t;
-
 // Registry for a user specified clean func
 typedef struct CleanFuncRegistry_t {
     // for identifying this registry
@@ -53,10 +21,39 @@ typedef struct CleanFuncRegistry_t {
     struct CleanFuncRegistry_t *next;
 } CleanFuncRegistry_t;
 
-// registered try regions, only removed and freed on exit
+// try regions and catch handlers emitted by try() and catch(), the linker puts each kind together into a table bounded
+// by these symbols. they are weak, as a program that has no try block has no such section
+extern TryRegion_t __start_c_try_catch_regions[] __attribute__((weak));
+extern TryRegion_t __stop_c_try_catch_regions[] __attribute__((weak));
+extern TryHandler_t __start_c_try_catch_handlers[] __attribute__((weak));
+extern TryHandler_t __stop_c_try_catch_handlers[] __attribute__((weak));
+
+// a try region in PC index
+typedef struct RegionNode_t {
+    TryRegion_t *region;
+
+    // the innermost region whose try block encloses this one, NULL if none
+    struct RegionNode_t *parent;
+} RegionNode_t;
+
+// PC index: every try region, sorted by start address, outer ones first if they start at the same address
+// try blocks are either nested or disjoint, so the innermost region covering a pc is the last one starting before it,
+// or one of its parents
 static struct {
-    RegionRegistry_t sentinel;
-} registered_regions;
+    RegionNode_t *nodes;
+    size_t size;
+} region_index;
+
+// handler index: open addressing hash table of catch handlers, keyed by region identifier and type identifier
+// its capacity is a power of 2, at least twice the number of handlers, so it is never full
+static struct {
+    TryHandler_t **slots;
+    size_t mask;
+} handler_index;
+
+// executions of try blocks in progress on this system thread, innermost first
+// each one lives in the stack frame running the try block, this only links them
+static __thread TryFrame_t *try_frames;
 
 // registered clean func, removed and freed after executing clean func
 struct {
@@ -65,26 +62,6 @@ struct {
 
 // --- data structure manipulation functions ---
 
-// allocate a zero-inited RegionRegistry_t, exit on failure
-static RegionRegistry_t *allocateRegionRegistry() {
-    RegionRegistry_t *t = calloc(sizeof(RegionRegistry_t), 1);
-    if (t) {
-        return t;
-    }
-    fprintf(stderr, "allocate RegionRegistry_t failed\n");
-    exit(1);
-}
-
-// allocate a zero-inited HandlerRegistry_t, exit on failure
-static HandlerRegistry_t *allocateHandlerRegistry() {
-    HandlerRegistry_t *c = calloc(sizeof(HandlerRegistry_t), 1);
-    if (c) {
-        return c;
-    }
-    fprintf(stderr, "allocate HandlerRegistry_t failed\n");
-    exit(1);
-}
-
 // allocate a zero-inited CleanFuncRegistry_t, exit on failure
 static CleanFuncRegistry_t *allocateCleanFuncRegistry() {
     CleanFuncRegistry_t *c = calloc(sizeof(CleanFuncRegistry_t), 1);
@@ -95,55 +72,20 @@ static CleanFuncRegistry_t *allocateCleanFuncRegistry() {
     exit(1);
 }
 
-// free memory owned by a HandlerRegistry_t
-static void freeHandlerRegistry(HandlerRegistry_t *h) {
-    free(h);
-}
-
-// free memory owned by a RegionRegistry_t, including its associated HandlerRegistry_t
-static void freeRegionRegistry(RegionRegistry_t *t) {
-    if (!t->sentinel_handlers.next) {
-        free(t->env);
-        free(t);
-        return;
-    }
-
-    HandlerRegistry_t *curr = t->sentinel_handlers.next;
-    while (curr) {
-        HandlerRegistry_t *next = curr->next;
-        freeHandlerRegistry(curr);
-        curr = next;
-    }
-
-    free(t->env);
-    free(t);
-}
-
 // free memory owned by a CleanFuncRegistry_t
 static void freeCleanFuncRegistry(CleanFuncRegistry_t *c) {
     free(c);
 }
 
-// push a RegionRegistry_t to global list, newly pushed ones are always first elements
-// do not check duplicate elements
-static void pushRegionRegistry(RegionRegistry_t *t) {
-    t->next = registered_regions.sentinel.next;
-    registered_regions.sentinel.next = t;
-}
-
-// push a HandlerRegistry_t to given RegionRegistry_t, newly pushed ones are always first elements
-// do not check duplicate elements
-static void pushHandlerRegistry(RegionRegistry_t *t, HandlerRegistry_t *c) {
-    c->next = t->sentinel_handlers.next;
-    t->sentinel_handlers.next = c;
-}
+// search the innermost try region that its try block can cover given pc
+// inner is used to specify starting point: for nested try block, there might be multiple regions satisfying it, the
+// one returned is the parent of inner. so each region is searched/returned only once, inner first
+// if inner is NULL, search from scratch
+static RegionNode_t *searchRegionByPC(void *pc, const RegionNode_t *inner) {
+    if (inner) {
+        return inner->parent;
+    }
 
-// search a RegionRegistry that its try block can cover given pc
-// header are used to specify starting point: for nested try block, there might be multiple regions satisfying it.
-// we use the staring point to make sure each region is searched/returned only once
-// if header is NULL, search from scratch
-// if remove is not zero, will dequeue found registry, if not NULL.
-static RegionRegistry_t *searchRegionRegistryByPC(void *pc, RegionRegistry_t *header, int remove) {
     // pc might point to the NEXT instruction to execute, it might exceed try block if it is the last line of code:
     // --- try start ---
     // ...
@@ -153,62 +95,60 @@ static RegionRegistry_t *searchRegionRegistryByPC(void *pc, RegionRegistry_t *he
     // nothing related to try       <-- pc points here
     pc = pc - 1;
 
-    // setup iteration starting point
-    RegionRegistry_t *curr, *prev;
-    if (!header) {
-        prev = &registered_regions.sentinel;
-        curr = registered_regions.sentinel.next;
-    } else {
-        prev = header;
-        curr = header->next;
+    // find the last region starting at or before pc
+    size_t low = 0, high = region_index.size;
+    while (low < high) {
+        size_t mid = low + (high - low) / 2;
+        if (region_index.nodes[mid].region->try_start <= pc) {
+            low = mid + 1;
+        } else {
+            high = mid;
+        }
+    }
+    if (!low) {
+        return NULL;
     }
 
-    // find satisfied registry
-    while (curr) {
-        if (pc >= curr->try_start && pc < curr->try_end) {
-            if (remove) {
-                prev->next = curr->next;
-            }
-            return curr;
-        }
-        prev = curr;
-        curr = curr->next;
+    // it ends before pc, but one of its parents might cover pc
+    RegionNode_t *n = &region_index.nodes[low - 1];
+    while (n && pc >= n->region->try_end) {
+        n = n->parent;
     }
-    return NULL;
+    return n;
 }
 
-// search a RegionRegistry by identifier
-// if remove is not zero, will dequeue found registry, if not NULL.
-static RegionRegistry_t *searchRegionRegistryByIdentifier(const void *region_identifier, int remove) {
-    RegionRegistry_t *curr = registered_regions.sentinel.next, *prev = &registered_regions.sentinel;
+// slot of a handler in handler index
+static size_t hashHandler(const void *region_identifier, ExceptionType_t type_identifier) {
+    uint64_t h = (uintptr_t)region_identifier ^ (uint64_t)(unsigned)type_identifier << 32;
+    h *= 0x9e3779b97f4a7c15ull;
+    return (size_t)(h >> 32) & handler_index.mask;
+}
 
-    while (curr) {
-        if (curr->region_identifier == region_identifier) {
-            if (remove) {
-                prev->next = curr->next;
-            }
-            return curr;
+// search a catch handler of given try region by given type identifier
+static TryHandler_t *searchHandler(const TryRegion_t *r, ExceptionType_t type_identifier) {
+    if (!handler_index.slots) {
+        return NULL;
+    }
+    size_t i = hashHandler(r->region_identifier, type_identifier);
+    TryHandler_t *h;
+    while ((h = handler_index.slots[i])) {
+        if (h->region_identifier == r->region_identifier && h->type_identifier == type_identifier) {
+            return h;
         }
-        prev = curr;
-        curr = curr->next;
+        i = (i + 1) & handler_index.mask;
     }
     return NULL;
 }
 
-// search a HandlerRegistry in given RegionRegistry by given type identifier
-// since the handler is unique for each type identifier, the return is unique
-// if remove is not zero, will dequeue found registry, if not NULL.
-static HandlerRegistry_t *searchHandlerRegistry(RegionRegistry_t *t, ExceptionType_t type_identifier, int remove) {
-    HandlerRegistry_t *curr = t->sentinel_handlers.next, *prev = &t->sentinel_handlers;
-    while (curr) {
-        if (curr->type_identifier == type_identifier) {
-            if (remove) {
-                prev->next = curr->next;
-            }
-            return curr;
+// search the execution of given try region by the function of given frame pointer
+// the stack grows downwards, so executions in outer functions have greater fp, stop there
+static TryFrame_t *searchTryFrame(const TryRegion_t *r, const void *fp) {
+    TryFrame_t *f = try_frames;
+    while (f && f->fp <= fp) {
+        if (f->region == r && f->fp == fp) {
+            return f;
         }
-        prev = curr;
-        curr = curr->next;
+        f = f->prev;
     }
     return NULL;
 }
@@ -276,75 +216,6 @@ void backtrace(void *fp, void **next_fp, void **pc) {
 
 // --- functions exposed(?) to user ---
 
-// register a try region which has address range try_start ~ try_end, with given region_identifier
-// the region_identifier is defined and obtained in try macro, user shall not define it by themselves
-void register_try(void *region_identifier, void *try_start, void *try_end, jmp_buf *env) {
-    // check memory allocation failure
-    if (!env) {
-        fprintf(stderr, "allocated catch env failed\n");
-        exit(1);
-    }
-
-    RegionRegistry_t *r;
-
-    // check if registry with given region_identifier exists, if so, update env and push it to the first 
-    if ((r = searchRegionRegistryByIdentifier(region_identifier, 1))) {
-
-#ifdef c_try_catch_debug
-        printf("[duplicate register try %p, remove old env]\n", region_identifier);
-#endif
-
-        free(r->env);
-        r->env = env;
-        pushRegionRegistry(r);
-        return;
-    }
-
-#ifdef c_try_catch_debug
-    printf("[register try %p: %p ~ %p]\n", region_identifier, try_start, try_end);
-#endif
-
-    // allocate new one, fill fields and push into global list
-    r = allocateRegionRegistry();
-    r->region_identifier = region_identifier;
-    r->try_start = try_start;
-    r->try_end = try_end;
-    r->env = env;
-    pushRegionRegistry(r);
-}
-
-// register a catch region which handles given type, it will be associated with the try region that has given
-// region_identifier
-// if the try region with region_identifier has already registered handler of given type, nothing is done
-void register_catch(void *region_identifier, ExceptionType_t type_identifier) {
-    // search for associated try region
-    RegionRegistry_t *t = searchRegionRegistryByIdentifier(region_identifier, 0);
-    if (t) {
-        // check if duplicate, if so, do nothing
-        if (searchHandlerRegistry(t, type_identifier, 0)) {
-
-#ifdef c_try_catch_debug
-            printf("[duplicate register catch type %d for %p]\n", type_identifier, region_identifier);
-#endif
-
-            return;
-        }
-
-#ifdef c_try_catch_debug
-        printf("[register catch type %d for %p]\n", type_identifier, region_identifier);
-#endif
-
-        // allocate memory for new one && push list
-        HandlerRegistry_t *c = allocateHandlerRegistry();
-        c->type_identifier = type_identifier;
-        pushHandlerRegistry(t, c);
-        return;
-    }
-    // not found, error
-    fprintf(stderr, "try to register catch for unknown try %p\n", region_identifier);
-    exit(1);
-}
-
 // throw an exception to given type with data pointer
 // this function will unwind the stack:
 // 1. check if registered clean function exists, if so, do clean and unregister it.
@@ -358,7 +229,7 @@ void throw_exception(ExceptionType_t type_identifier, void *data) {
 
     void *current_fp = __builtin_frame_address(0), *next_fp, *pc = NULL;
     
-    RegionRegistry_t *r = NULL;
+    RegionNode_t *n = NULL;
 
     // the caller might have the same frame pointer with the current function
     while (current_fp) {
@@ -383,19 +254,21 @@ void throw_exception(ExceptionType_t type_identifier, void *data) {
             }
         }
 
-        // then, use return address of the frame to determine if it is in registered try block
+        // then, use return address of the frame to determine if it is in a try block
         while (1) {
             // find satisfied try block, it might be nested, so we need to do multiple times
-            // since newly registered try block is always push to the first, and the search starts from the first, this
-            // guarantees inner try block is the first to be returned
-            if ((r = searchRegionRegistryByPC(pc, r, 0)) != NULL) {
+            // the search returns the innermost one enclosing the last one, this guarantees inner try block is the first
+            // to be returned
+            if ((n = searchRegionByPC(pc, n)) != NULL) {
+                TryRegion_t *r = n->region;
 
 #ifdef c_try_catch_debug
-                printf("[found registered try block %p]\n", r->region_identifier);
+                printf("[found try block %p]\n", r->region_identifier);
 #endif
 
-                // try block found, find catch block
-                if (searchHandlerRegistry(r, type_identifier, 0)) {
+                // try block found, find catch block, and the execution of the try block in this frame to jump into
+                TryFrame_t *f;
+                if (searchHandler(r, type_identifier) && (f = searchTryFrame(r, current_fp))) {
 
 #ifdef c_try_catch_debug
                     printf("[found type %d handler in %p]\n", type_identifier, r->region_identifier);
@@ -403,10 +276,12 @@ void throw_exception(ExceptionType_t type_identifier, void *data) {
 #endif
 
                     // catch block found, setup for catch block getting thrown data
-                    r->type = type_identifier;
-                    r->data = data;
+                    f->type = type_identifier;
+                    f->data = data;
+                    // executions inside it are unwound, and it is finished once its catch block runs
+                    try_frames = f->prev;
                     // jump into catch block, do not return
-                    longjmp(*r->env, 0);
+                    longjmp(f->env, 0);
                 }
                 // satisfied catch block not found, search next satisfied try block
                 continue;
@@ -422,21 +297,29 @@ void throw_exception(ExceptionType_t type_identifier, void *data) {
     exit(1);
 }
 
-// get thrown exception info if in catch block, the result is unknown if not called properly
-void get_exception_info(const void *region_identifier, ExceptionType_t *type, void **data) {
-    RegionRegistry_t *t = searchRegionRegistryByIdentifier(region_identifier, 0);
-    if (t) {
+// get thrown exception info if in catch block of given execution, the result is unknown if not called properly
+void get_exception_info(const TryFrame_t *frame, ExceptionType_t *type, void **data) {
 
 #ifdef c_try_catch_debug
-        printf("[read exception info in %p: type %d, data %p]\n", t->region_identifier, t->type, t->data);
+    printf("[read exception info in %p: type %d, data %p]\n", frame->region->region_identifier, frame->type, frame->data);
 #endif
 
-        *type = t->type;
-        *data = t->data;
-        return;
+    *type = frame->type;
+    *data = frame->data;
+}
+
+// push an execution of try block, called by try()
+void enter_try(TryFrame_t *frame) {
+    frame->prev = try_frames;
+    try_frames = frame;
+}
+
+// pop an execution of try block, called when the scope of try() is left
+// it has been popped by throw_exception() already if its catch block is running
+void leave_try(TryFrame_t *frame) {
+    if (try_frames == frame) {
+        try_frames = frame->prev;
     }
-    fprintf(stderr, "try to read info of unknown region_identifier %p\n", region_identifier);
-    exit(1);
 }
 
 // register a clean func, which will be called with given arg
@@ -480,18 +363,89 @@ void unregister_clean_func(const void *identifier) {
     }
 }
 
-// --- destructor ---
+// --- constructor & destructor ---
+
+// order try regions by start address, outer ones first
+static int compareRegionNode(const void *a, const void *b) {
+    const TryRegion_t *x = ((const RegionNode_t *)a)->region, *y = ((const RegionNode_t *)b)->region;
+    if (x->try_start != y->try_start) {
+        return x->try_start < y->try_start ? -1 : 1;
+    }
+    if (x->try_end != y->try_end) {
+        return x->try_end > y->try_end ? -1 : 1;
+    }
+    return 0;
+}
+
+// build PC index and handler index from the tables emitted by try() and catch(), before main() runs
+__attribute__((constructor))
+void buildIndex() {
+    size_t n_regions = __stop_c_try_catch_regions - __start_c_try_catch_regions;
+    size_t n_handlers = __stop_c_try_catch_handlers - __start_c_try_catch_handlers;
+    if (!n_regions) {
+        return;
+    }
+
+    region_index.nodes = calloc(n_regions, sizeof(RegionNode_t));
+    size_t capacity = 2;
+    while (capacity < n_handlers * 2) {
+        capacity *= 2;
+    }
+    handler_index.slots = calloc(capacity, sizeof(TryHandler_t *));
+    if (!region_index.nodes || !handler_index.slots) {
+        fprintf(stderr, "allocate try catch index failed\n");
+        exit(1);
+    }
+    handler_index.mask = capacity - 1;
+
+    region_index.size = n_regions;
+    for (size_t i = 0; i < n_regions; i++) {
+        region_index.nodes[i].region = &__start_c_try_catch_regions[i];
+    }
+    qsort(region_index.nodes, n_regions, sizeof(RegionNode_t), compareRegionNode);
+
+    // link each region to the innermost one enclosing it, candidates are kept in a stack from outer to inner
+    RegionNode_t **stack = malloc(n_regions * sizeof(RegionNode_t *));
+    if (!stack) {
+        fprintf(stderr, "allocate try catch index failed\n");
+        exit(1);
+    }
+    size_t depth = 0;
+    for (size_t i = 0; i < n_regions; i++) {
+        RegionNode_t *node = &region_index.nodes[i];
+        while (depth && stack[depth - 1]->region->try_end < node->region->try_end) {
+            depth--;
+        }
+        node->parent = depth ? stack[depth - 1] : NULL;
+        stack[depth++] = node;
+    }
+    free(stack);
+
+    // a catch block that handles the same type as an earlier one of the same try block never runs, skip it
+    for (TryHandler_t *h = __start_c_try_catch_handlers; h < __stop_c_try_catch_handlers; h++) {
+        size_t i = hashHandler(h->region_identifier, h->type_identifier);
+        while (handler_index.slots[i]) {
+            TryHandler_t *t = handler_index.slots[i];
+            if (t->region_identifier == h->region_identifier && t->type_identifier == h->type_identifier) {
+                break;
+            }
+            i = (i + 1) & handler_index.mask;
+        }
+        if (!handler_index.slots[i]) {
+            handler_index.slots[i] = h;
+        }
+    }
+
+#ifdef c_try_catch_debug
+    printf("[indexed %zu try regions, %zu catch handlers]\n", n_regions, n_handlers);
+#endif
+}
 
 // free everything on exit
 __attribute__((destructor))
 void cleanUpALL() {
-    RegionRegistry_t *curr = registered_regions.sentinel.next;
-    while (curr) {
-        RegionRegistry_t *next = curr->next;
-        freeRegionRegistry(curr);
-        curr = next;
-    }
-
+    free(region_index.nodes);
+    free(handler_index.slots);
     CleanFuncRegistry_t *c = registered_clean.sentinel.next;
     while (c) {
 
@@ -12,14 +12,64 @@ typedef int ExceptionType_t;
 
 typedef void (*CleanFunc_t) (void *);
 
+// a try block, emitted into section c_try_catch_regions by try(), so the linker collects the try blocks of the whole
+// program into a table, nothing is registered at runtime
+typedef struct TryRegion_t {
+    // a value that identifies this try block, the address of its _region_identifier label
+    void *region_identifier;
+
+    // start & end address of this try block, obtained by label
+    void *try_start;
+    void *try_end;
+} TryRegion_t;
+
+// an execution of a try block, declared by try() in the stack frame running it, so entering a try block allocates
+// nothing. the executions of a system thread are linked into a stack, the innermost one on top. it is popped whenever
+// its scope is left, by finally() or by return/break/goto out of the try block
+typedef struct TryFrame_t {
+    // the try block being executed
+    const TryRegion_t *region;
+
+    // frame pointer of the function executing it, tells executions of the same try block apart under recursion
+    void *fp;
+
+    // entry point of associated catch blocks
+    jmp_buf env;
+
+    // thrown exception info, set before jumping into the catch blocks
+    ExceptionType_t type;
+    void *data;
+
+    // the execution enclosing this one
+    struct TryFrame_t *prev;
+} TryFrame_t;
+
+// a catch block, emitted into section c_try_catch_handlers by catch()
+typedef struct TryHandler_t {
+    // the try block it belongs to
+    void *region_identifier;
+
+    // which type shall this catch block handle?
+    ExceptionType_t type_identifier;
+} TryHandler_t;
+
+// put a static variable into given section, the table of a section is only an array if no entry is over-aligned
+#define _try_catch_entry(section_, type_)   \
+    __attribute__((used, aligned(__alignof__(type_)), section(#section_)))
+
 #ifdef __OPTIMIZE__
 
 #define try(group_index, try_block)   \
 {   \
 _region_identifier ## group_index:    \
-    jmp_buf *_env ## group_index = malloc(sizeof(jmp_buf));    \
-    extern void register_try(void *region_identifier, void *try_start, void *try_end, jmp_buf *env);    \
-    register_try(&&_region_identifier ## group_index, &&_try_start ## group_index, &&_try_end ## group_index, _env ## group_index);    \
+    static TryRegion_t _region ## group_index _try_catch_entry(c_try_catch_regions, TryRegion_t) = {    \
+        &&_region_identifier ## group_index, &&_try_start ## group_index, &&_try_end ## group_index   \
+    };  \
+    extern void enter_try(TryFrame_t *frame), leave_try(TryFrame_t *frame);   \
+    TryFrame_t _frame ## group_index __attribute__((cleanup(leave_try))) = {   \
+        &_region ## group_index, __builtin_frame_address(0)  \
+    };  \
+    enter_try(&_frame ## group_index);  \
     goto _catch_init ## group_index; \
 _try_start ## group_index:    \
     void __attribute((noinline)) _bf ## group_index() {   \
@@ -29,16 +79,21 @@ _try_start ## group_index:    \
 _try_end ## group_index:  \
     goto _finally ## group_index; \
 _catch_init ## group_index:    \
-    int _stage_catch ## group_index = setjmp(*_env ## group_index);
+    int _stage_catch ## group_index = setjmp(_frame ## group_index.env);
 
 #else
 
 #define try(group_index, try_block)   \
 {   \
 _region_identifier ## group_index:    \
-    jmp_buf *_env ## group_index = malloc(sizeof(jmp_buf));    \
-    extern void register_try(void *region_identifier, void *try_start, void *try_end, jmp_buf *env);    \
-    register_try(&&_region_identifier ## group_index, &&_try_start ## group_index, &&_try_end ## group_index, _env ## group_index);    \
+    static TryRegion_t _region ## group_index _try_catch_entry(c_try_catch_regions, TryRegion_t) = {    \
+        &&_region_identifier ## group_index, &&_try_start ## group_index, &&_try_end ## group_index   \
+    };  \
+    extern void enter_try(TryFrame_t *frame), leave_try(TryFrame_t *frame);   \
+    TryFrame_t _frame ## group_index __attribute__((cleanup(leave_try))) = {   \
+        &_region ## group_index, __builtin_frame_address(0)  \
+    };  \
+    enter_try(&_frame ## group_index);  \
     goto _catch_init ## group_index; \
 _try_start ## group_index:    \
     {   \
@@ -47,20 +102,20 @@ _try_start ## group_index:    \
 _try_end ## group_index:  \
     goto _finally ## group_index;   \
 _catch_init ## group_index:    \
-    int _stage_catch ## group_index = setjmp(*_env ## group_index);
+    int _stage_catch ## group_index = setjmp(_frame ## group_index.env);
 
 #endif
 
-
+// type shall be a constant expression, as the handler is emitted at compile time
 #define catch(group_index, type, data, catch_block) \
-    if (!_stage_catch ## group_index) {  \
-        extern void register_catch(void *region_identifier, ExceptionType_t type_identifier);   \
-        register_catch(&&_region_identifier ## group_index, type);  \
-    } else {    \
+    if (_stage_catch ## group_index) {  \
+        static TryHandler_t _handler _try_catch_entry(c_try_catch_handlers, TryHandler_t) = {  \
+            &&_region_identifier ## group_index, type \
+        };  \
         ExceptionType_t _t;  \
         void *data; \
-        extern void get_exception_info(const void *region_identifier, ExceptionType_t *type_, void **data);  \
-        get_exception_info(&&_region_identifier ## group_index, &_t, &data); \
+        extern void get_exception_info(const TryFrame_t *frame, ExceptionType_t *type_, void **data);  \
+        get_exception_info(&_frame ## group_index, &_t, &data); \
         if (_t == type) {   \
             {   \
                 catch_block \
@@ -4,6 +4,7 @@
 #define BadShitHappenedException0 0
 #define WhatHellException1 1
 #define IDKException2 2
+#define EarlyReturnException3 3
 
 void free3(void *ptr) {
     printf("clean main!\n");
@@ -55,6 +56,20 @@ void func1() {
     printf("func1 return\n");
 }
 
+// leaves its try block by return, finally is not reached
+void returnEarly() {
+    try(0, {
+        printf("return early\n");
+        return;
+    }) catch(0, EarlyReturnException3, data, {
+        printf("never\n");
+    }) finally(0)
+}
+
+void throwAfterReturnEarly() {
+    throw(EarlyReturnException3, "after early return");
+}
+
 int main() {
     int a = 114514;
     try(0, {
@@ -91,6 +106,13 @@ int main() {
         printf("my lovely local again %d\n", a);
     }) finally(3)
 
+    try(4, {
+        returnEarly();
+        throwAfterReturnEarly();
+    }) catch(4, EarlyReturnException3, data, {
+        printf("caught %s\n", (char *)data);
+    }) finally(4)
+
     printf("main ret\n");
 
     return 0;
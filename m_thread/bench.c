@@ -0,0 +1,447 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <sched.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <sys/resource.h>
+#include "m_thread.h"
+
+// scheduler microbenchmarks at 10, 1k and 100k threads, each run with m_thread and with pthreads
+// usage: ./bench [workers], workers defaults to 1. the process is pinned to that many cpus, so pthreads get the same
+// cpus as m_thread workers
+// a pthread benchmark that can't create all its threads (see kernel.threads-max) is reported as n/a
+
+// both kinds of threads get this stack, without guard, so 100k of them don't run out of memory mappings
+#define STACK_SIZE (64 * 1024)
+// total operations per benchmark, divided among the threads
+#define YIELDS 1000000
+#define ROUND_TRIPS 1000000
+#define SLEEPS 100000
+#define WAKEUPS 100000
+// sleep length in sleep benchmark
+#define SLEEP_US 1000
+
+static unsigned int workers = 1;
+
+static uint64_t now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+// cpu time used by the process in ns
+static uint64_t cpuTime() {
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    return (usage.ru_utime.tv_sec + usage.ru_stime.tv_sec) * 1000000000ull +
+           (usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) * 1000ull;
+}
+
+// operations per thread, at least min
+static long share(long total, long n, long min) {
+    return total / n > min ? total / n : min;
+}
+
+// --- runners ---
+
+// the function every thread of a benchmark runs, with its index
+static void (*body)(long i);
+// time the first thread starts
+static uint64_t first_start;
+
+static void mthreadEntry(void *arg) {
+    if (!first_start) {
+        first_start = now();
+    }
+    body((long)arg);
+}
+
+// run n m_threads of f, return ns from the first one starts until all return, -1 if they can't be created
+static double mthreadRun(long n, void (*f)(long)) {
+    body = f;
+    first_start = 0;
+    for (long i = 0; i < n; i++) {
+        m_thread_t thread;
+        if (m_thread_create(&thread, mthreadEntry, (void *)i)) {
+            return -1;
+        }
+        m_thread_detach(thread);
+    }
+    m_thread_config_t config = {.workers = workers};
+    m_thread_start_config(&config);
+    return now() - first_start;
+}
+
+// pthreads wait at the gate until all of them are created, or leave if creation failed
+static pthread_mutex_t gate_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t gate_cond = PTHREAD_COND_INITIALIZER;
+static int gate_open, gate_cancelled;
+
+static void *pthreadEntry(void *arg) {
+    pthread_mutex_lock(&gate_lock);
+    while (!gate_open && !gate_cancelled) {
+        pthread_cond_wait(&gate_cond, &gate_lock);
+    }
+    int cancelled = gate_cancelled;
+    pthread_mutex_unlock(&gate_lock);
+    if (!cancelled) {
+        body((long)arg);
+    }
+    return NULL;
+}
+
+// run n pthreads of f, return ns from all are created until all return, -1 if they can't be created
+static double pthreadRun(long n, void (*f)(long)) {
+    body = f;
+    gate_open = gate_cancelled = 0;
+    pthread_t *threads = malloc(n * sizeof(pthread_t));
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setstacksize(&attr, STACK_SIZE);
+    pthread_attr_setguardsize(&attr, 0);
+    long created = 0;
+    while (created < n && !pthread_create(&threads[created], &attr, pthreadEntry, (void *)created)) {
+        created++;
+    }
+    pthread_attr_destroy(&attr);
+
+    uint64_t start = now();
+    pthread_mutex_lock(&gate_lock);
+    if (created == n) {
+        gate_open = 1;
+    } else {
+        gate_cancelled = 1;
+    }
+    pthread_cond_broadcast(&gate_cond);
+    pthread_mutex_unlock(&gate_lock);
+    for (long i = 0; i < created; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    free(threads);
+    return created == n ? (double)(now() - start) : -1;
+}
+
+// --- create / exit ---
+
+static void empty(long i) {
+}
+
+// ns per thread created, run and exited. threads exit as soon as they start
+static double createMthread(long n) {
+    uint64_t start = now();
+    if (mthreadRun(n, empty) < 0) {
+        return -1;
+    }
+    return (double)(now() - start) / n;
+}
+
+// pthreads are created and joined 1000 at a time, as the kernel limits how many can exist at once
+static double createPthread(long n) {
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setstacksize(&attr, STACK_SIZE);
+    pthread_attr_setguardsize(&attr, 0);
+    pthread_t threads[1000];
+    uint64_t start = now();
+    for (long done = 0; done < n; done += 1000) {
+        long batch = n - done < 1000 ? n - done : 1000;
+        long created = 0;
+        while (created < batch && !pthread_create(&threads[created], &attr, (void *(*)(void *))empty, NULL)) {
+            created++;
+        }
+        for (long i = 0; i < created; i++) {
+            pthread_join(threads[i], NULL);
+        }
+        if (created < batch) {
+            pthread_attr_destroy(&attr);
+            return -1;
+        }
+    }
+    pthread_attr_destroy(&attr);
+    return (double)(now() - start) / n;
+}
+
+// --- yield ---
+
+static long yields;
+
+static void yieldMthread(long i) {
+    for (long j = 0; j < yields; j++) {
+        m_thread_yield();
+    }
+}
+
+static void yieldPthread(long i) {
+    for (long j = 0; j < yields; j++) {
+        sched_yield();
+    }
+}
+
+// ns per yield, every thread yields in a loop
+static double yieldBench(long n, double (*run)(long, void (*)(long)), void (*f)(long)) {
+    yields = share(YIELDS, n, 10);
+    double ns = run(n, f);
+    return ns < 0 ? -1 : ns / (n * yields);
+}
+
+static double yieldM(long n) {
+    return yieldBench(n, mthreadRun, yieldMthread);
+}
+
+static double yieldP(long n) {
+    return yieldBench(n, pthreadRun, yieldPthread);
+}
+
+// --- ping-pong ---
+
+// threads 2k and 2k + 1 pass a token to each other through a pair of semaphores
+static long round_trips;
+static m_sem_t *m_sems;
+static sem_t *p_sems;
+
+static void pingpongMthread(long i) {
+    m_sem_t *mine = &m_sems[i], *peer = &m_sems[i ^ 1];
+    for (long j = 0; j < round_trips; j++) {
+        if (i & 1) {
+            m_sem_wait(mine);
+            m_sem_post(peer);
+        } else {
+            m_sem_post(peer);
+            m_sem_wait(mine);
+        }
+    }
+}
+
+static void pingpongPthread(long i) {
+    sem_t *mine = &p_sems[i], *peer = &p_sems[i ^ 1];
+    for (long j = 0; j < round_trips; j++) {
+        if (i & 1) {
+            sem_wait(mine);
+            sem_post(peer);
+        } else {
+            sem_post(peer);
+            sem_wait(mine);
+        }
+    }
+}
+
+// ns per round trip, all pairs run at the same time
+static double pingpongM(long n) {
+    round_trips = share(ROUND_TRIPS, n / 2, 10);
+    m_sems = malloc(n * sizeof(m_sem_t));
+    for (long i = 0; i < n; i++) {
+        m_sem_init(&m_sems[i], 0);
+    }
+    double ns = mthreadRun(n, pingpongMthread);
+    free(m_sems);
+    return ns < 0 ? -1 : ns / (n / 2 * round_trips);
+}
+
+static double pingpongP(long n) {
+    round_trips = share(ROUND_TRIPS, n / 2, 10);
+    p_sems = malloc(n * sizeof(sem_t));
+    for (long i = 0; i < n; i++) {
+        sem_init(&p_sems[i], 0, 0);
+    }
+    double ns = pthreadRun(n, pingpongPthread);
+    for (long i = 0; i < n; i++) {
+        sem_destroy(&p_sems[i]);
+    }
+    free(p_sems);
+    return ns < 0 ? -1 : ns / (n / 2 * round_trips);
+}
+
+// --- sleep ---
+
+static long sleeps;
+
+static void sleepMthread(long i) {
+    for (long j = 0; j < sleeps; j++) {
+        m_thread_usleep(SLEEP_US);
+    }
+}
+
+static void sleepPthread(long i) {
+    struct timespec ts = {.tv_nsec = SLEEP_US * 1000};
+    for (long j = 0; j < sleeps; j++) {
+        nanosleep(&ts, NULL);
+    }
+}
+
+// cpu time in ns spent per sleep, every thread sleeps in a loop
+static double sleepBench(long n, double (*run)(long, void (*)(long)), void (*f)(long)) {
+    sleeps = share(SLEEPS, n, 2);
+    uint64_t cpu = cpuTime();
+    if (run(n, f) < 0) {
+        return -1;
+    }
+    return (double)(cpuTime() - cpu) / (n * sleeps);
+}
+
+static double sleepM(long n) {
+    return sleepBench(n, mthreadRun, sleepMthread);
+}
+
+static double sleepP(long n) {
+    return sleepBench(n, pthreadRun, sleepPthread);
+}
+
+// --- wakeup ---
+
+// thread 0 wakes up every other thread in turn through its semaphore, and waits until it has run before waking up the
+// next one. each of them adds up the time from its wakeup to it runs
+static long rounds, waiters;
+static uint64_t *posted, *latency;
+static m_sem_t m_done;
+static sem_t p_done;
+
+static void wakeupMthread(long i) {
+    for (long j = 0; j < rounds; j++) {
+        if (i) {
+            m_sem_wait(&m_sems[i]);
+            latency[i] += now() - posted[i];
+            m_sem_post(&m_done);
+            continue;
+        }
+        for (long k = 1; k <= waiters; k++) {
+            posted[k] = now();
+            m_sem_post(&m_sems[k]);
+            m_sem_wait(&m_done);
+        }
+    }
+}
+
+static void wakeupPthread(long i) {
+    for (long j = 0; j < rounds; j++) {
+        if (i) {
+            sem_wait(&p_sems[i]);
+            latency[i] += now() - posted[i];
+            sem_post(&p_done);
+            continue;
+        }
+        for (long k = 1; k <= waiters; k++) {
+            posted[k] = now();
+            sem_post(&p_sems[k]);
+            sem_wait(&p_done);
+        }
+    }
+}
+
+// average ns from a thread is woken up until it runs
+static double wakeupBench(long n, int pthread) {
+    waiters = n - 1;
+    rounds = share(WAKEUPS, waiters, 2);
+    posted = calloc(n, sizeof(uint64_t));
+    latency = calloc(n, sizeof(uint64_t));
+    double ns;
+    if (pthread) {
+        p_sems = malloc(n * sizeof(sem_t));
+        for (long i = 0; i < n; i++) {
+            sem_init(&p_sems[i], 0, 0);
+        }
+        sem_init(&p_done, 0, 0);
+        ns = pthreadRun(n, wakeupPthread);
+        for (long i = 0; i < n; i++) {
+            sem_destroy(&p_sems[i]);
+        }
+        sem_destroy(&p_done);
+        free(p_sems);
+    } else {
+        m_sems = malloc(n * sizeof(m_sem_t));
+        for (long i = 0; i < n; i++) {
+            m_sem_init(&m_sems[i], 0);
+        }
+        m_sem_init(&m_done, 0);
+        ns = mthreadRun(n, wakeupMthread);
+        free(m_sems);
+    }
+    uint64_t total = 0;
+    for (long i = 1; i < n; i++) {
+        total += latency[i];
+    }
+    free(posted);
+    free(latency);
+    return ns < 0 ? -1 : (double)total / (waiters * rounds);
+}
+
+static double wakeupM(long n) {
+    return wakeupBench(n, 0);
+}
+
+static double wakeupP(long n) {
+    return wakeupBench(n, 1);
+}
+
+// --- main ---
+
+typedef struct Bench {
+    const char *name;
+    const char *unit;
+    double (*mthread)(long n);
+    double (*pthread)(long n);
+} Bench;
+
+static const Bench benches[] = {
+    {"create/exit", "ns per thread", createMthread, createPthread},
+    {"yield", "ns per yield", yieldM, yieldP},
+    {"ping-pong", "ns per round trip", pingpongM, pingpongP},
+    {"sleep", "cpu ns per sleep", sleepM, sleepP},
+    {"wakeup", "ns latency", wakeupM, wakeupP},
+};
+
+#define N_BENCHES (sizeof(benches) / sizeof(benches[0]))
+
+static const long sizes[] = {10, 1000, 100000};
+
+#define N_SIZES (sizeof(sizes) / sizeof(sizes[0]))
+
+int main(int argc, char *argv[]) {
+    if (argc > 1) {
+        workers = atoi(argv[1]);
+    }
+    if (!workers) {
+        fprintf(stderr, "usage: %s [workers]\n", argv[0]);
+        return 1;
+    }
+    // pthreads get the cpus m_thread workers get
+    cpu_set_t cpus;
+    CPU_ZERO(&cpus);
+    for (unsigned int i = 0; i < workers; i++) {
+        CPU_SET(i, &cpus);
+    }
+    if (sched_setaffinity(0, sizeof(cpus), &cpus)) {
+        perror("sched_setaffinity failed");
+    }
+    m_thread_set_stack(STACK_SIZE, 0);
+
+    // m_thread_start_config() prints a line every time, so results are printed at the end
+    double results[N_BENCHES][N_SIZES][2];
+    for (size_t b = 0; b < N_BENCHES; b++) {
+        for (size_t s = 0; s < N_SIZES; s++) {
+            results[b][s][0] = benches[b].mthread(sizes[s]);
+            results[b][s][1] = benches[b].pthread(sizes[s]);
+        }
+    }
+
+    printf("\n%u worker(s)\n", workers);
+    printf("%-12s %-18s %8s %12s %12s %8s\n", "benchmark", "unit", "threads", "m_thread", "pthread", "ratio");
+    for (size_t b = 0; b < N_BENCHES; b++) {
+        for (size_t s = 0; s < N_SIZES; s++) {
+            double m = results[b][s][0], p = results[b][s][1];
+            printf("%-12s %-18s %8ld ", benches[b].name, benches[b].unit, sizes[s]);
+            if (m < 0) {
+                printf("%12s ", "n/a");
+            } else {
+                printf("%12.1f ", m);
+            }
+            if (p < 0) {
+                printf("%12s %8s\n", "n/a", "-");
+            } else {
+                printf("%12.1f %8.2f\n", p, m < 0 ? 0 : p / m);
+            }
+        }
+    }
+    return 0;
+}
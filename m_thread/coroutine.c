@@ -0,0 +1,90 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include "m_thread.h"
+
+// 100k coroutines sleep and yield, while one of them reads lines a thread writes to a pipe
+
+#define N 100000
+
+struct sleeper {
+    m_co_t co;
+    int round;
+};
+
+static long total;
+
+int sleeper(void *arg) {
+    struct sleeper *s = arg;
+    M_CO_BEGIN(&s->co);
+    for (s->round = 0; s->round < 3; s->round++) {
+        M_CO_AWAIT(&s->co, m_co_sleep(10000));
+        M_CO_YIELD(&s->co);
+    }
+    __atomic_add_fetch(&total, 1, __ATOMIC_RELAXED);
+    M_CO_END(&s->co);
+}
+
+struct reader {
+    m_co_t co;
+    int fd;
+    char buf[64];
+    ssize_t n;
+};
+
+int reader(void *arg) {
+    struct reader *r = arg;
+    M_CO_BEGIN(&r->co);
+    while (1) {
+        // m_thread_read() can't park a coroutine, it returns EAGAIN
+        while ((r->n = m_thread_read(r->fd, r->buf, sizeof(r->buf) - 1)) < 0 && errno == EAGAIN) {
+            M_CO_AWAIT(&r->co, m_co_wait_read(r->fd));
+        }
+        if (r->n <= 0) {
+            break;
+        }
+        r->buf[r->n] = 0;
+        m_thread_log("[coroutine] read: %s", r->buf);
+    }
+    M_CO_END(&r->co);
+}
+
+void writer(void *arg) {
+    int fd = (int)(long)arg;
+    for (int i = 0; i < 3; i++) {
+        char line[32];
+        int len = snprintf(line, sizeof(line), "line %d\n", i);
+        m_thread_write(fd, line, len);
+        m_thread_usleep(20000);
+    }
+    close(fd);
+}
+
+int main() {
+    struct sleeper *sleepers = calloc(N, sizeof(struct sleeper));
+    m_thread_t id;
+    for (int i = 0; i < N; i++) {
+        m_co_create(&id, sleeper, &sleepers[i]);
+        m_thread_detach(id);
+    }
+
+    int fds[2];
+    if (pipe(fds)) {
+        perror("pipe");
+        return 1;
+    }
+    struct reader r = {.fd = fds[0]};
+    m_co_create(&id, reader, &r);
+    m_thread_detach(id);
+    m_thread_create(&id, writer, (void *)(long)fds[1]);
+    m_thread_detach(id);
+
+    m_thread_start();
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    printf("%ld of %d coroutines done, max rss %ld KiB\n", total, N, usage.ru_maxrss);
+    free(sleepers);
+    return 0;
+}
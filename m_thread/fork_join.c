@@ -0,0 +1,60 @@
+#include <stdio.h>
+#include <stdint.h>
+#include "m_thread.h"
+
+// ranges smaller than this are summed up directly
+#define LEAF_SIZE 1000
+
+struct range {
+    uint64_t begin;
+    uint64_t end;
+};
+
+// sum up [begin, end) by splitting it into two halves, each summed up by a new thread
+void sum(void *arg) {
+    struct range *range = arg;
+    uint64_t total = 0;
+    if (range->end - range->begin <= LEAF_SIZE) {
+        for (uint64_t i = range->begin; i < range->end; i++) {
+            total += i;
+        }
+        m_thread_exit((void *)(uintptr_t)total);
+    }
+
+    uint64_t mid = range->begin + (range->end - range->begin) / 2;
+    struct range halves[2] = {{range->begin, mid}, {mid, range->end}};
+    m_thread_t t[2];
+    for (int i = 0; i < 2; i++) {
+        if (m_thread_create(&t[i], sum, &halves[i])) {
+            m_thread_log("create failed\n");
+            return;
+        }
+    }
+    // the thread is parked until the child finishes
+    for (int i = 0; i < 2; i++) {
+        void *result;
+        m_thread_join(t[i], &result);
+        total += (uintptr_t)result;
+    }
+    m_thread_exit((void *)(uintptr_t)total);
+}
+
+int main() {
+    struct range range = {0, 10000000};
+    m_thread_t root;
+    m_thread_create(&root, sum, &range);
+
+    m_thread_config_t config = {.workers = 0};
+    m_thread_start_config(&config);
+
+    // every thread has finished, join the root to get the result
+    void *result;
+    if (m_thread_join(root, &result)) {
+        printf("join failed\n");
+        return 1;
+    }
+    printf("sum of [%llu, %llu): %llu, expected %llu\n", (unsigned long long)range.begin,
+           (unsigned long long)range.end, (unsigned long long)(uintptr_t)result,
+           (unsigned long long)((range.end - 1) * range.end / 2));
+    return 0;
+}
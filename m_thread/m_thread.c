@@ -1,383 +1,4277 @@
+#define _GNU_SOURCE
 #include "m_thread.h"
 #include <ucontext.h>
 #include <sys/ucontext.h>
 #include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
 #include <signal.h>
 #include <stdio.h>
 #include <time.h>
 #include <unistd.h>
+#include <sched.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <errno.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
 #include <bits/sigaction.h>
 #include <bits/sigstack.h>
 
 #define INTERRUPT_SIGNAL SIGUSR1
 
+// older glibc does not expose it
+#ifndef sigev_notify_thread_id
+#define sigev_notify_thread_id _sigev_un._tid
+#endif
+
 // millisecond to nanosecond
 #define MS_TO_NS(ms) (ms * 1000000)
 
-// 10ms
-#define INTERRUPT_INTERVAL MS_TO_NS(10)
+// default quantum (time slice of a thread), 10ms
+#define DEFAULT_QUANTUM MS_TO_NS(10)
+
+// shortest time the timer is armed for
+#define MIN_TIMER_NS 50000
+
+// default weight of a thread in M_SCHED_FAIR
+#define DEFAULT_WEIGHT 1024
+
+// capacity of a worker's local run queue, must be power of 2
+#define LOCAL_QUEUE_SIZE 256
+
+// check global queue first every GLOBAL_QUEUE_INTERVAL schedule rounds, so it won't starve behind local queue
+#define GLOBAL_QUEUE_INTERVAL 61
+
+// how often a busy worker checks I/O readiness, if some threads are waiting for it
+#define POLL_INTERVAL_NS 1000000
+
+// max number of events handled by one epoll_wait()
+#define MAX_EVENTS 64
+
+// default number of system threads running m_thread_offload() calls
+#define DEFAULT_OFFLOAD_THREADS 4
+
+// entries of the io_uring submission queue of each worker
+#define URING_ENTRIES 256
+// a worker submits its queued io_uring requests once this many are queued
+#define URING_BATCH 32
+
+// fd table is made of FD_TABLE_SIZE lazily allocated chunks, each holds FD_CHUNK_SIZE fd states
+#define FD_CHUNK_SIZE 1024
+#define FD_TABLE_SIZE 1024
+
+// initial capacity of a worker's sleep heap and run heap
+#define TASK_HEAP_INIT_SIZE 64
+
+// default stack size and guard size of a thread, see m_thread_set_stack()
+#define DEFAULT_STACK_SIZE (256 * 1024)
+#define DEFAULT_STACK_GUARD_SIZE 4096
+
+// smallest stack size accepted by m_thread_set_stack()
+#define MIN_STACK_SIZE (16 * 1024)
+
+// max number of freed stacks kept for reuse
+#define STACK_CACHE_SIZE 1024
+
+// initial number of buckets of thread record table, must be power of 2
+#define RECORD_TABLE_INIT_SIZE 256
+
+// size of a slab of a pool, and max number of slabs of a pool, see Pool_t
+#define POOL_SLAB_SIZE (1024 * 1024)
+#define POOL_MAX_SLABS 4096
+
+// size of a worker's log buffer, and max length of a message, see m_thread_log()
+#define LOG_BUFFER_SIZE 4096
+#define LOG_LINE_SIZE 1024
+
+// wait_state of a task, see parkCurrent() and wakeTask()
+// running or in a run queue
+#define TASK_RUNNING 0
+// about to park, still running
+#define TASK_PARKING 1
+// parked, not in any run queue, only wakeTask() can bring it back
+#define TASK_PARKED 2
+// woken up before it actually parks, so it shall not park
+#define TASK_NOTIFIED 3
+
+// --- context switch ---
+
+#if (defined(__x86_64__) || defined(__i386__)) && !defined(M_THREAD_UCONTEXT)
+
+// Context_t: a suspended context is just its stack pointer, callee-saved registers, fpu control words and the address
+// to resume are saved on its stack by switchContext()
+// signal mask is not part of it, so switching costs no syscall
+typedef struct Context_t {
+    void *sp;
+} Context_t;
+
+// save current context into from, then resume to
+__attribute__((visibility("hidden"))) void switchContext(Context_t *from, Context_t *to);
+
+#if defined(__x86_64__)
+__asm__(
+    ".text\n"
+    ".globl switchContext\n"
+    ".hidden switchContext\n"
+    ".type switchContext, @function\n"
+    "switchContext:\n"
+    "    pushq %rbp\n"
+    "    pushq %rbx\n"
+    "    pushq %r12\n"
+    "    pushq %r13\n"
+    "    pushq %r14\n"
+    "    pushq %r15\n"
+    "    subq $8, %rsp\n"
+    "    stmxcsr (%rsp)\n"
+    "    fnstcw 4(%rsp)\n"
+    "    movq %rsp, (%rdi)\n"
+    "    movq (%rsi), %rsp\n"
+    "    ldmxcsr (%rsp)\n"
+    "    fldcw 4(%rsp)\n"
+    "    addq $8, %rsp\n"
+    "    popq %r15\n"
+    "    popq %r14\n"
+    "    popq %r13\n"
+    "    popq %r12\n"
+    "    popq %rbx\n"
+    "    popq %rbp\n"
+    "    ret\n"
+    ".size switchContext, .-switchContext\n"
+);
+#else
+__asm__(
+    ".text\n"
+    ".globl switchContext\n"
+    ".hidden switchContext\n"
+    ".type switchContext, @function\n"
+    "switchContext:\n"
+    "    movl 4(%esp), %eax\n"
+    "    movl 8(%esp), %edx\n"
+    "    pushl %ebp\n"
+    "    pushl %ebx\n"
+    "    pushl %esi\n"
+    "    pushl %edi\n"
+    "    subl $8, %esp\n"
+    "    stmxcsr (%esp)\n"
+    "    fnstcw 4(%esp)\n"
+    "    movl %esp, (%eax)\n"
+    "    movl (%edx), %esp\n"
+    "    ldmxcsr (%esp)\n"
+    "    fldcw 4(%esp)\n"
+    "    addl $8, %esp\n"
+    "    popl %edi\n"
+    "    popl %esi\n"
+    "    popl %ebx\n"
+    "    popl %ebp\n"
+    "    ret\n"
+    ".size switchContext, .-switchContext\n"
+);
+#endif
+
+// prepare a context that runs entry on given stack when it is switched to, entry shall never return
+static int makeContext(Context_t *context, char *stack, size_t size, void (*entry)(void)) {
+    // stack grows down, 16-byte aligned like right before a call instruction
+    void **sp = (void **)(((uintptr_t)stack + size) & ~(uintptr_t)15);
+    // fake return address of entry
+    *--sp = NULL;
+    // switchContext() returns here
+    *--sp = (void *)entry;
+#if defined(__x86_64__)
+    // rbp rbx r12 r13 r14 r15
+    for (int i = 0; i < 6; i++) {
+        *--sp = NULL;
+    }
+    // default mxcsr, and x87 control word
+    *--sp = (void *)(uintptr_t)0x0000037f00001f80;
+#else
+    // ebp ebx esi edi
+    for (int i = 0; i < 4; i++) {
+        *--sp = NULL;
+    }
+    // default x87 control word, and mxcsr
+    *--sp = (void *)(uintptr_t)0x037f;
+    *--sp = (void *)(uintptr_t)0x1f80;
+#endif
+    context->sp = sp;
+    return 0;
+}
+
+#else
+
+// other architectures: fall back to ucontext
+typedef struct Context_t {
+    ucontext_t uc;
+} Context_t;
+
+static void switchContext(Context_t *from, Context_t *to) {
+    swapcontext(&from->uc, &to->uc);
+}
+
+static int makeContext(Context_t *context, char *stack, size_t size, void (*entry)(void)) {
+    if (getcontext(&context->uc)) {
+        return -1;
+    }
+    context->uc.uc_stack.ss_sp = stack;
+    context->uc.uc_stack.ss_size = size;
+    context->uc.uc_link = NULL;
+    // it might be created with timer interrupt blocked
+    sigdelset(&context->uc.uc_sigmask, INTERRUPT_SIGNAL);
+    makecontext(&context->uc, entry, 0);
+    return 0;
+}
+
+#endif
+
+// --- scheduler ---
+
+// ThreadRecord_t: join state of a thread, outlives its task until it is joined or detached
+typedef struct ThreadRecord_t {
+    m_thread_t thread_id;
+    // next record in the same bucket
+    struct ThreadRecord_t *next;
+    int exited;
+    int detached;
+    // set by m_thread_exit()
+    void *result;
+    // the task waiting for it in m_thread_join()
+    struct TaskStruct_t *joiner;
+    // the task itself, NULL once it is finished
+    struct TaskStruct_t *task;
+    // index in record_pool
+    uint32_t pool_index;
+    // statistics of the task when it finished
+    m_thread_stats_t stats;
+} ThreadRecord_t;
+
+typedef struct TaskStruct_t {
+    m_thread_t thread_id;
+    struct TaskStruct_t *prev;
+    struct TaskStruct_t *next;
+
+    // scheduler it runs on, set when it is created and never changed
+    m_sched_t *sched;
+
+    // the task can't be preempted if it is not 0. a task switched out always has it set, so a timer interrupt that
+    // comes in the middle of a context switch leaves it alone
+    volatile int no_preempt;
+    // a timer interrupt arrived while no_preempt was set, yield once it is cleared by m_thread_preempt_enable()
+    volatile int preempt_pending;
+    // the task has returned, its scheduler will free it
+    int exited;
+
+    void (*func)(void *);
+    void *arg;
+    // stackless coroutine: it has no stack or context, step is called on scheduler's stack until it returns
+    // M_CO_DONE. NULL for threads
+    int (*step)(void *arg);
+
+    // the whole mapping: guard, stack, and this struct at its top. NULL for a coroutine, which lives in coroutine_pool
+    char *stack;
+    uint32_t pool_index;
+    size_t stack_size;
+    // size of the guard at the bottom of the mapping, 0 if it has none
+    size_t guard_size;
+    Context_t context;
+
+    ThreadRecord_t *record;
+
+    _Atomic int wait_state;
+
+    // CLOCK_MONOTONIC time in ns to wake up, if it is sleeping
+    uint64_t wake_time;
+
+    // scheduling parameters, see m_thread_sched_t
+    int priority;
+    unsigned int weight;
+    // time slice in ns, 0 means the scheduler's quantum
+    uint64_t quantum;
+    // M_SCHED_FAIR: weighted run time in ns, the task with least of it runs first
+    uint64_t vruntime;
+    // CLOCK_MONOTONIC time in ns it is switched in, only tracked if some policy needs it (see track_runtime)
+    uint64_t dispatch_time;
+
+    // switched out by timer interrupt rather than m_thread_yield(), the scheduler clears it
+    int preempted;
+    // CLOCK_MONOTONIC time in ns it became runnable, only tracked if collect_stats is set
+    uint64_t ready_time;
+    m_thread_stats_t stats;
+
+    // values of thread local storage keys, indexed by key
+    void *specific[M_THREAD_KEYS_MAX];
+
+    // CANCEL_PENDING and CANCEL_DISABLED bits
+    _Atomic int cancel_state;
+    // M_THREAD_CANCEL_DEFERRED or M_THREAD_CANCEL_ASYNCHRONOUS
+    int cancel_type;
+    // worker and fd it has waited on last time, m_thread_cancel() looks for it there. they may be stale, as both live
+    // as long as the scheduler
+    struct Worker_t *_Atomic sleep_worker;
+    struct FdState_t *_Atomic wait_fd;
+    // switched out by a timer interrupt outside critical sections, so its stack can be dropped if it is canceled
+    int killable;
+    // CLOCK_MONOTONIC time in ns it is canceled at, 0 if it has no deadline. protected by deadline_lock
+    uint64_t deadline;
+
+    // task group it has been spawned into, NULL if none
+    m_task_group_t *group;
+} TaskStruct_t;
+
+// TaskStruct_t.cancel_state
+// m_thread_cancel() has been called, or its deadline has passed
+#define CANCEL_PENDING 1
+// it is exiting, cancellation points don't act any more
+#define CANCEL_DISABLED 2
+
+// TaskQueue_t: doubly linked list of tasks, push, pop and remove are all O(1)
+// a zero-initialized one is empty, a task can be in at most one TaskQueue_t at the same time
+// it is m_thread_queue_t, so synchronization primitives in m_thread.h can hold their waiters
+typedef m_thread_queue_t TaskQueue_t;
+
+// LocalQueue_t: bounded ring buffer of runnable tasks owned by a worker
+// only the owner pushes at tail, while both owner and other workers (steal) pop at head by CAS, so no lock is needed
+typedef struct LocalQueue_t {
+    _Atomic uint32_t head;
+    _Atomic uint32_t tail;
+    TaskStruct_t *_Atomic tasks[LOCAL_QUEUE_SIZE];
+} LocalQueue_t;
+
+// TaskHeap_t: min-heap of tasks ordered by key, which is taken when the task is pushed
+// sleep heap of a worker is ordered by wake_time, run heap (M_SCHED_PRIORITY and M_SCHED_FAIR) by policy
+typedef struct HeapEntry_t {
+    uint64_t key;
+    TaskStruct_t *task;
+} HeapEntry_t;
+
+typedef struct TaskHeap_t {
+    HeapEntry_t *entries;
+    size_t size;
+    size_t capacity;
+} TaskHeap_t;
+
+// FdState_t: threads waiting for a fd to be ready
+typedef struct FdState_t {
+    // protects the fields below
+    _Atomic int lock;
+
+    TaskQueue_t readers;
+    TaskQueue_t writers;
+
+    // FD_UNKNOWN until a read or write with io_uring in use checks it. a fd closed and reused behind our back may keep
+    // a stale one, which only costs performance
+    _Atomic int type;
+} FdState_t;
+
+// FdState_t.type
+#define FD_UNKNOWN 0
+#define FD_POLLABLE 1
+// regular file or block device, epoll can't poll it
+#define FD_FILE 2
+
+// Uring_t: io_uring instance of a worker. only the worker queues and submits requests, any worker may reap completions
+typedef struct Uring_t {
+    int fd;
+
+    // submission queue, shared with the kernel
+    _Atomic unsigned *sq_head;
+    _Atomic unsigned *sq_tail;
+    unsigned sq_mask;
+    unsigned sq_entries;
+    struct io_uring_sqe *sqes;
+    // requests queued but not submitted yet, and CLOCK_MONOTONIC time in ns the oldest of them was queued
+    unsigned pending;
+    uint64_t pending_since;
+
+    // completion queue, shared with the kernel, protected by lock
+    _Atomic int lock;
+    _Atomic unsigned *cq_head;
+    _Atomic unsigned *cq_tail;
+    unsigned cq_mask;
+    unsigned cq_entries;
+    struct io_uring_cqe *cqes;
+
+    // requests queued and not reaped yet, kept below cq_entries so the completion queue never overflows
+    _Atomic unsigned inflight;
+
+    // mappings of the rings
+    void *sq_ring;
+    size_t sq_ring_size;
+    void *cq_ring;
+    size_t cq_ring_size;
+    size_t sqes_size;
+} Uring_t;
+
+// Worker_t: a system thread that runs user threads
+typedef struct Worker_t {
+    unsigned int index;
+    pthread_t thread;
+    m_sched_t *sched;
+
+    // schedule_context: context of schedule() function
+    Context_t schedule_context;
+
+    // signal mask while waiting in idle(), blocks timer interrupt
+    sigset_t idle_mask;
+
+    // one-shot timer of this worker, only interrupts this worker. it is armed only when another task wants this worker,
+    // see prepareTimer()
+    timer_t timer;
+    volatile sig_atomic_t timer_armed;
+    // CLOCK_MONOTONIC time in ns the timer fires at, if it is armed
+    uint64_t timer_deadline;
+    // number of tasks switched in, and its value when the timer was armed
+    unsigned long dispatch_seq;
+    unsigned long armed_seq;
+
+    // schedule round counter
+    unsigned int tick;
+
+    // M_SCHED_RR: local run queue
+    LocalQueue_t queue;
+
+    // M_SCHED_PRIORITY and M_SCHED_FAIR: local run queue, protected by run_lock as other workers steal from it
+    TaskHeap_t run_heap;
+    _Atomic int run_lock;
+    // M_SCHED_PRIORITY: push counter, so tasks of the same priority run in FIFO order
+    uint32_t run_seq;
+    // M_SCHED_FAIR: vruntime of the task last switched in, tasks pushed are not placed much before it
+    uint64_t min_vruntime;
+
+    // tasks slept on this worker, ordered by wake_time. only this worker pushes and pops, under sleep_lock as
+    // m_thread_cancel() takes them out
+    TaskHeap_t sleepers;
+    _Atomic int sleep_lock;
+
+    // last time this worker checked I/O readiness
+    uint64_t last_poll;
+
+    // file I/O requests of tasks running on this worker, if use_uring
+    Uring_t uring;
+
+    // messages of m_thread_log() not written yet
+    size_t log_len;
+    char log[LOG_BUFFER_SIZE];
+} Worker_t;
+
+// SchedPolicy_t: a scheduling policy, which is how a worker's local run queue orders tasks
+typedef struct SchedPolicy_t {
+    void (*push)(Worker_t *worker, TaskStruct_t *task);
+    TaskStruct_t *(*pop)(Worker_t *worker);
+    TaskStruct_t *(*steal)(Worker_t *worker, Worker_t *victim);
+    uint32_t (*room)(Worker_t *worker);
+    // no task in local run queue
+    int (*empty)(Worker_t *worker);
+    // key of a task in run heap, if the policy uses it
+    uint64_t (*key)(Worker_t *worker, TaskStruct_t *task);
+    // charge the task for ran ns of cpu time, if the policy needs it
+    void (*account)(TaskStruct_t *task, uint64_t ran);
+} SchedPolicy_t;
+
+static const SchedPolicy_t rr_policy, priority_policy, fair_policy;
+
+// how a time slice ends
+#define SLICE_PREEMPTED 0
+#define SLICE_YIELDED 1
+#define SLICE_PARKED 2
+#define SLICE_EXITED 3
+
+// a time slice of a task on a worker
+typedef struct TraceEvent_t {
+    m_thread_t thread_id;
+    // CLOCK_MONOTONIC time in ns
+    uint64_t start;
+    uint64_t end;
+    int reason;
+} TraceEvent_t;
+
+// the last trace_size time slices of a worker, only the worker writes it
+typedef struct TraceRing_t {
+    TraceEvent_t *events;
+    // number of events ever recorded, events[count % trace_size] is the next one
+    size_t count;
+} TraceRing_t;
+
+// a call of m_thread_offload(), it lives on the stack of the calling thread, which is parked until it completes
+typedef struct OffloadJob_t {
+    void *(*fn)(void *);
+    void *arg;
+    void *result;
+    // errno after fn returns
+    int err;
+    TaskStruct_t *task;
+    struct OffloadJob_t *next;
+} OffloadJob_t;
+
+// a request submitted to io_uring, it lives on the stack of the calling thread, which is parked until it completes
+typedef struct UringOp_t {
+    TaskStruct_t *task;
+    // result of the request, negative errno if it fails
+    int res;
+} UringOp_t;
+
+#define NO_DEADLINE UINT64_MAX
+
+// m_sched_t: a scheduler. its workers share run queues, the I/O reactor, deadlines and the offload pool, nothing of it
+// is shared with another scheduler, so schedulers started on different system threads run independently
+struct m_sched_t {
+    // scheduling policy in use, selected by m_sched_start()
+    const SchedPolicy_t *policy;
+
+    // timer interrupt interval, and time slice of threads that don't have their own, in ns
+    uint64_t sched_quantum;
+
+    // dispatch_time of tasks is tracked, as the policy charges run time, or some task has its own quantum
+    int track_runtime;
+
+    // cpu time and run queue wait time of tasks are measured, see m_thread_stats_t
+    int collect_stats;
+
+    // trace of each worker, kept after m_sched_start() returns for m_sched_trace_export(), NULL if not traced
+    TraceRing_t *trace_rings;
+    unsigned int trace_ring_count;
+    size_t trace_size;
+    // CLOCK_MONOTONIC time in ns the traced run started
+    uint64_t trace_start;
+
+    // task_list: global queue, holds tasks created outside workers and overflowed from local queues
+    TaskQueue_t task_list;
+
+    // protects task_list
+    pthread_mutex_t task_list_lock;
+
+    // number of tasks in task_list, can be read without lock
+    _Atomic size_t task_list_size;
+
+    // all the workers
+    Worker_t *workers;
+    unsigned int n_workers;
+
+    // number of tasks not finished yet
+    _Atomic long live_tasks;
+
+    // schedule context has started, or is being started
+    _Atomic int started;
+
+    // epoll instance of the I/O reactor, shared by all workers
+    int epoll_fd;
+
+    // eventfd in epoll_fd, used to wake up idle workers
+    int wake_fd;
+
+    // wake_fd has been written but not read yet
+    _Atomic int wake_pending;
+
+    // number of workers waiting in idle()
+    _Atomic unsigned int idle_workers;
+
+    // number of threads waiting for I/O, or for an offloaded call
+    _Atomic long io_waiters;
+
+    // tasks that have a deadline, ordered by it, protected by deadline_lock. a finished task is taken out of it
+    TaskHeap_t deadline_heap;
+    _Atomic int deadline_lock;
+
+    // the earliest deadline in deadline_heap, can be read without lock
+    _Atomic uint64_t next_deadline;
+
+    // offload pool: system threads that run offloaded calls, started by the first call. jobs wait in a FIFO queue
+    // protected by offload_lock
+    pthread_mutex_t offload_lock;
+    pthread_cond_t offload_cond;
+    OffloadJob_t *offload_head, *offload_tail;
+    pthread_t *offload_threads;
+    unsigned int offload_thread_count;
+    // number of threads to start, set by m_sched_start()
+    unsigned int offload_pool_size;
+    int offload_stop;
+
+    // completed jobs, pushed by offload threads, taken all at once by the worker that reads offload_fd
+    OffloadJob_t *_Atomic offload_done;
+
+    // eventfd in epoll_fd, written by offload threads when a job completes
+    int offload_fd;
+
+    // file I/O goes through io_uring, set by m_sched_start() if io_uring of every worker is set up
+    int use_uring;
+
+    // eventfd in epoll_fd, signaled by io_uring of every worker when a request completes
+    int uring_fd;
+
+    // fd -> FdState_t
+    FdState_t *_Atomic fd_table[FD_TABLE_SIZE];
+};
+
+#define SCHED_INITIALIZER {                             \
+    .policy = &rr_policy,                               \
+    .sched_quantum = DEFAULT_QUANTUM,                   \
+    .task_list_lock = PTHREAD_MUTEX_INITIALIZER,        \
+    .epoll_fd = -1,                                     \
+    .wake_fd = -1,                                      \
+    .next_deadline = NO_DEADLINE,                       \
+    .offload_lock = PTHREAD_MUTEX_INITIALIZER,          \
+    .offload_cond = PTHREAD_COND_INITIALIZER,           \
+    .offload_pool_size = DEFAULT_OFFLOAD_THREADS,       \
+    .offload_fd = -1,                                   \
+    .uring_fd = -1,                                     \
+}
+
+// scheduler of m_thread_start_config(), and of threads created outside any scheduler
+static m_sched_t default_sched = SCHED_INITIALIZER;
+
+// worker of the calling system thread, NULL if it is not a worker
+static __thread Worker_t *local_worker;
+
+// task running on the calling system thread, NULL if it is in scheduler or not a worker
+// initial-exec model makes reading it a single %fs/%gs relative load, so a task that is moved to another worker right
+// before the load still gets itself
+static __thread TaskStruct_t *volatile local_task __attribute__((tls_model("initial-exec")));
+
+// used to indicate thread id, shared by all schedulers
+static _Atomic m_thread_t thread_count;
+
+// stack size and guard size of threads created afterwards
+static size_t stack_size = DEFAULT_STACK_SIZE;
+static size_t stack_guard_size = DEFAULT_STACK_GUARD_SIZE;
+
+// lock-free stack (Treiber) of indexes, the links between them are kept by its user. the head packs the top index
+// with a tag that changes on every update, so a pop that read a stale top fails its CAS instead of corrupting the
+// stack (ABA). INDEX_NONE marks the bottom
+typedef _Atomic uint64_t IndexStack_t;
+
+#define INDEX_NONE UINT32_MAX
+
+// freed tasks (with their stacks) that allocateTask() reuses, each in a slot of stack_slots. occupied slots and free
+// slots are two index stacks, linked by stack_slot_links
+static TaskStruct_t *stack_slots[STACK_CACHE_SIZE];
+static _Atomic uint32_t stack_slot_links[STACK_CACHE_SIZE];
+static IndexStack_t cached_stacks = INDEX_NONE;
+static IndexStack_t free_stack_slots = INDEX_NONE;
+// slots ever used, free_stack_slots only holds the ones given back
+static _Atomic uint32_t stack_slots_used;
+
+// fixed size objects carved from mmap'd slabs, and recycled through a lock-free free list, so allocating them
+// neither calls malloc() nor takes a lock. slabs are never unmapped, so a pop that lost its race still reads mapped
+// memory. object i of slab n has index n << 16 | i, and its link is in an array after the objects of its slab
+typedef struct Pool_t {
+    size_t object_size;
+    // objects per slab, set when the first slab is mapped
+    uint32_t slab_objects;
+    IndexStack_t free;
+    char *slabs[POOL_MAX_SLABS];
+    _Atomic uint32_t slab_count;
+    // held while mapping a new slab
+    _Atomic int grow_lock;
+} Pool_t;
+
+// thread id -> ThreadRecord_t, chained hash table. thread ids are sequential, so id modulo size spreads them evenly
+static ThreadRecord_t **record_table;
+static size_t record_table_size;
+static size_t record_count;
+static _Atomic int record_lock;
+
+// ThreadRecord_t, and tasks of coroutines
+static Pool_t record_pool = {.object_size = sizeof(ThreadRecord_t), .free = INDEX_NONE};
+static Pool_t coroutine_pool = {.object_size = (sizeof(TaskStruct_t) + 63) & ~(size_t)63, .free = INDEX_NONE};
+
+// thread local storage keys in use, and their destructors, protected by key_lock
+static int key_used[M_THREAD_KEYS_MAX];
+static void (*key_destructors[M_THREAD_KEYS_MAX])(void *);
+static _Atomic int key_lock;
+
+// get worker of the calling system thread
+// user thread may be moved to another worker after a context switch, so never cache the result across one
+static __attribute__((noinline)) Worker_t *currentWorker() {
+    return local_worker;
+}
+
+// get current task, NULL if not in a task
+static __attribute__((noinline)) TaskStruct_t *currentTask() {
+    return local_task;
+}
+
+// get current task if it is a thread, NULL if not in a task or in a coroutine
+// a coroutine can't be switched out in the middle, so functions that would park it behave as if it is not in a task
+static TaskStruct_t *currentThread() {
+    TaskStruct_t *task = currentTask();
+    return task && !task->step ? task : NULL;
+}
+
+// simple spin lock, holder shall not be interrupted, and shall not hold it for long
+static void spinLock(_Atomic int *lock) {
+    while (atomic_exchange_explicit(lock, 1, memory_order_acquire)) {
+        while (atomic_load_explicit(lock, memory_order_relaxed)) {
+            sched_yield();
+        }
+    }
+}
+
+static void spinUnlock(_Atomic int *lock) {
+    atomic_store_explicit(lock, 0, memory_order_release);
+}
+
+// if some workers of sched are idle, wake one of them up to take the new runnable task
+static void notifyIdleWorker(m_sched_t *sched) {
+    // pairs with idle(): either this sees the idle worker, or the idle worker sees the new task
+    atomic_thread_fence(memory_order_seq_cst);
+    if (atomic_load(&sched->idle_workers) && !atomic_exchange(&sched->wake_pending, 1)) {
+        uint64_t one = 1;
+        if (write(sched->wake_fd, &one, sizeof(one)) < 0) {
+            atomic_store(&sched->wake_pending, 0);
+        }
+    }
+}
+
+// append a task to the tail of queue
+static void enqueueTask(TaskQueue_t *q, TaskStruct_t *task) {
+    task->next = NULL;
+    task->prev = q->tail;
+    if (q->tail) {
+        q->tail->next = task;
+    } else {
+        q->head = task;
+    }
+    q->tail = task;
+    q->size++;
+}
+
+// remove given task from queue, the task must be in it
+static void removeQueuedTask(TaskQueue_t *q, TaskStruct_t *task) {
+    if (task->prev) {
+        task->prev->next = task->next;
+    } else {
+        q->head = task->next;
+    }
+    if (task->next) {
+        task->next->prev = task->prev;
+    } else {
+        q->tail = task->prev;
+    }
+    task->prev = task->next = NULL;
+    q->size--;
+}
+
+// remove and return the head of queue, return might be null
+static TaskStruct_t *dequeueTask(TaskQueue_t *q) {
+    TaskStruct_t *task = q->head;
+    if (task) {
+        removeQueuedTask(q, task);
+    }
+    return task;
+}
+
+static uint64_t getTime();
+
+// push a task into global task list of its scheduler
+static void pushTask(TaskStruct_t *task) {
+    if (!task) {
+        return;
+    }
+    m_sched_t *sched = task->sched;
+    if (sched->collect_stats) {
+        task->ready_time = getTime();
+    }
+    pthread_mutex_lock(&sched->task_list_lock);
+    enqueueTask(&sched->task_list, task);
+    atomic_store(&sched->task_list_size, sched->task_list.size);
+    pthread_mutex_unlock(&sched->task_list_lock);
+    notifyIdleWorker(sched);
+}
+
+static void pushLocalTask(Worker_t *worker, TaskStruct_t *task);
+static uint32_t localQueueRoom(Worker_t *worker);
+
+// pop the first task of global task list of worker's scheduler, return might be null
+// a fair share of the rest is moved into worker's local queue as well, so workers don't fight for the lock task by
+// task
+static TaskStruct_t *popTask(Worker_t *worker) {
+    m_sched_t *sched = worker->sched;
+    if (!atomic_load(&sched->task_list_size)) {
+        return NULL;
+    }
+    pthread_mutex_lock(&sched->task_list_lock);
+    TaskStruct_t *task = dequeueTask(&sched->task_list);
+    if (task) {
+        size_t n = sched->task_list.size / sched->n_workers;
+        uint32_t room = localQueueRoom(worker);
+        if (n > room) {
+            n = room;
+        }
+        while (n--) {
+            pushLocalTask(worker, dequeueTask(&sched->task_list));
+        }
+    }
+    atomic_store(&sched->task_list_size, sched->task_list.size);
+    pthread_mutex_unlock(&sched->task_list_lock);
+    return task;
+}
+
+// M_SCHED_RR: local run queue is a lock-free ring buffer
+
+// free space of worker's local queue, only the owner worker can call it
+static uint32_t ringRoom(Worker_t *worker) {
+    uint32_t head = atomic_load_explicit(&worker->queue.head, memory_order_acquire);
+    uint32_t tail = atomic_load_explicit(&worker->queue.tail, memory_order_relaxed);
+    return LOCAL_QUEUE_SIZE - (tail - head);
+}
+
+static int ringEmpty(Worker_t *worker) {
+    return atomic_load_explicit(&worker->queue.head, memory_order_relaxed) ==
+           atomic_load_explicit(&worker->queue.tail, memory_order_relaxed);
+}
+
+// push a task into worker's local queue, only the owner worker can call it
+// if local queue is full, push it into global task list instead
+static void pushRingTask(Worker_t *worker, TaskStruct_t *task) {
+    LocalQueue_t *q = &worker->queue;
+    uint32_t head = atomic_load_explicit(&q->head, memory_order_acquire);
+    uint32_t tail = atomic_load_explicit(&q->tail, memory_order_relaxed);
+    if (tail - head < LOCAL_QUEUE_SIZE) {
+        atomic_store_explicit(&q->tasks[tail % LOCAL_QUEUE_SIZE], task, memory_order_relaxed);
+        atomic_store_explicit(&q->tail, tail + 1, memory_order_release);
+        // the only worker is the caller itself, it is not idle
+        if (worker->sched->n_workers > 1) {
+            notifyIdleWorker(worker->sched);
+        }
+        return;
+    }
+    pushTask(task);
+}
+
+// pop the first task of worker's local queue, only the owner worker can call it
+// return might be null
+static TaskStruct_t *popRingTask(Worker_t *worker) {
+    LocalQueue_t *q = &worker->queue;
+    while (1) {
+        uint32_t head = atomic_load_explicit(&q->head, memory_order_acquire);
+        uint32_t tail = atomic_load_explicit(&q->tail, memory_order_relaxed);
+        if (head == tail) {
+            return NULL;
+        }
+        TaskStruct_t *task = atomic_load_explicit(&q->tasks[head % LOCAL_QUEUE_SIZE], memory_order_relaxed);
+        // other workers may steal it at the same time
+        if (atomic_compare_exchange_weak_explicit(&q->head, &head, head + 1, memory_order_release,
+                                                  memory_order_relaxed)) {
+            return task;
+        }
+    }
+}
+
+// steal half of the tasks in victim's local queue into worker's local queue, which must be empty
+// return one of the stolen tasks, might be null
+static TaskStruct_t *stealRingTask(Worker_t *worker, Worker_t *victim) {
+    LocalQueue_t *from = &victim->queue, *to = &worker->queue;
+    uint32_t to_tail = atomic_load_explicit(&to->tail, memory_order_relaxed);
+    uint32_t n;
+    while (1) {
+        uint32_t head = atomic_load_explicit(&from->head, memory_order_acquire);
+        uint32_t tail = atomic_load_explicit(&from->tail, memory_order_acquire);
+        n = tail - head;
+        n = n - n / 2;
+        if (n == 0) {
+            return NULL;
+        }
+        // head and tail are read separately, the snapshot might be inconsistent
+        if (n > LOCAL_QUEUE_SIZE / 2) {
+            continue;
+        }
+        // copy first, then claim them: if the claim fails, the copy is discarded
+        for (uint32_t i = 0; i < n; i++) {
+            TaskStruct_t *task = atomic_load_explicit(&from->tasks[(head + i) % LOCAL_QUEUE_SIZE],
+                                                      memory_order_relaxed);
+            atomic_store_explicit(&to->tasks[(to_tail + i) % LOCAL_QUEUE_SIZE], task, memory_order_relaxed);
+        }
+        if (atomic_compare_exchange_weak_explicit(&from->head, &head, head + n, memory_order_acq_rel,
+                                                  memory_order_relaxed)) {
+            break;
+        }
+    }
+
+    // run the last one, publish the rest
+    n--;
+    TaskStruct_t *task = atomic_load_explicit(&to->tasks[(to_tail + n) % LOCAL_QUEUE_SIZE], memory_order_relaxed);
+    if (n) {
+        atomic_store_explicit(&to->tail, to_tail + n, memory_order_release);
+    }
+    return task;
+}
+
+// CLOCK_MONOTONIC time in ns
+static uint64_t getTime() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+// push a task into heap with given key
+// return -1 on allocation failure
+static int heapPush(TaskHeap_t *heap, uint64_t key, TaskStruct_t *task) {
+    if (heap->size == heap->capacity) {
+        size_t capacity = heap->capacity ? heap->capacity * 2 : TASK_HEAP_INIT_SIZE;
+        HeapEntry_t *entries = realloc(heap->entries, capacity * sizeof(HeapEntry_t));
+        if (!entries) {
+            return -1;
+        }
+        heap->entries = entries;
+        heap->capacity = capacity;
+    }
+
+    // sift up
+    size_t i = heap->size++;
+    while (i > 0) {
+        size_t parent = (i - 1) / 2;
+        if (heap->entries[parent].key <= key) {
+            break;
+        }
+        heap->entries[i] = heap->entries[parent];
+        i = parent;
+    }
+    heap->entries[i] = (HeapEntry_t){key, task};
+    return 0;
+}
+
+// remove the entry at index i of heap
+static void heapRemove(TaskHeap_t *heap, size_t i) {
+    HeapEntry_t last = heap->entries[--heap->size];
+    if (i == heap->size) {
+        return;
+    }
+
+    // last takes the hole, sift up if it is less than the parent of the hole
+    while (i > 0) {
+        size_t parent = (i - 1) / 2;
+        if (heap->entries[parent].key <= last.key) {
+            break;
+        }
+        heap->entries[i] = heap->entries[parent];
+        i = parent;
+    }
+    // sift down
+    while (1) {
+        size_t child = i * 2 + 1;
+        if (child >= heap->size) {
+            break;
+        }
+        if (child + 1 < heap->size && heap->entries[child + 1].key < heap->entries[child].key) {
+            child++;
+        }
+        if (last.key <= heap->entries[child].key) {
+            break;
+        }
+        heap->entries[i] = heap->entries[child];
+        i = child;
+    }
+    heap->entries[i] = last;
+}
+
+// remove and return the task with the least key in heap, which must not be empty
+static TaskStruct_t *heapPop(TaskHeap_t *heap) {
+    TaskStruct_t *top = heap->entries[0].task;
+    heapRemove(heap, 0);
+    return top;
+}
+
+// remove task from heap, return 0 if it is not there
+static int heapTake(TaskHeap_t *heap, TaskStruct_t *task) {
+    for (size_t i = 0; i < heap->size; i++) {
+        if (heap->entries[i].task == task) {
+            heapRemove(heap, i);
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// the task has been canceled, and is not exiting yet
+static int cancelPending(TaskStruct_t *task) {
+    return (atomic_load(&task->cancel_state) & (CANCEL_PENDING | CANCEL_DISABLED)) == CANCEL_PENDING;
+}
+
+// push a task into worker's sleep heap unless it has been canceled, only the owner worker can call it
+// return -1 on allocation failure, 1 if it is canceled
+static int pushSleeper(Worker_t *worker, TaskStruct_t *task) {
+    // m_thread_cancel() marks the task before looking for it, so either it finds the task here, or the task sees
+    // the mark
+    atomic_store(&task->sleep_worker, worker);
+    spinLock(&worker->sleep_lock);
+    int ret = cancelPending(task) ? 1 : heapPush(&worker->sleepers, task->wake_time, task);
+    spinUnlock(&worker->sleep_lock);
+    return ret;
+}
+
+// M_SCHED_PRIORITY and M_SCHED_FAIR: local run queue is a heap ordered by a key given by the policy
+
+// tasks of the same priority are ordered by push order
+static uint64_t priorityKey(Worker_t *worker, TaskStruct_t *task) {
+    // higher priority, smaller key
+    uint32_t rank = ~((uint32_t)task->priority ^ 0x80000000u);
+    return (uint64_t)rank << 32 | worker->run_seq++;
+}
+
+static uint64_t fairKey(Worker_t *worker, TaskStruct_t *task) {
+    // a task that has been sleeping, is new, or comes from another worker shall not monopolize the worker to catch up
+    uint64_t quantum = worker->sched->sched_quantum;
+    uint64_t floor = worker->min_vruntime > quantum ? worker->min_vruntime - quantum : 0;
+    if (task->vruntime < floor) {
+        task->vruntime = floor;
+    }
+    return task->vruntime;
+}
+
+static void fairAccount(TaskStruct_t *task, uint64_t ran) {
+    task->vruntime += ran * DEFAULT_WEIGHT / task->weight;
+}
+
+static uint32_t heapRoom(Worker_t *worker) {
+    // unbounded
+    return LOCAL_QUEUE_SIZE;
+}
+
+// other workers ask it too, see hasRunnableTask()
+static int heapEmpty(Worker_t *worker) {
+    spinLock(&worker->run_lock);
+    int empty = !worker->run_heap.size;
+    spinUnlock(&worker->run_lock);
+    return empty;
+}
+
+static void pushHeapTask(Worker_t *worker, TaskStruct_t *task) {
+    spinLock(&worker->run_lock);
+    int err = heapPush(&worker->run_heap, worker->sched->policy->key(worker, task), task);
+    spinUnlock(&worker->run_lock);
+    if (err) {
+        // out of memory
+        pushTask(task);
+        return;
+    }
+    if (worker->sched->n_workers > 1) {
+        notifyIdleWorker(worker->sched);
+    }
+}
+
+static TaskStruct_t *popHeapTask(Worker_t *worker) {
+    TaskStruct_t *task = NULL;
+    spinLock(&worker->run_lock);
+    if (worker->run_heap.size) {
+        uint64_t key = worker->run_heap.entries[0].key;
+        task = heapPop(&worker->run_heap);
+        if (key > worker->min_vruntime) {
+            worker->min_vruntime = key;
+        }
+    }
+    spinUnlock(&worker->run_lock);
+    return task;
+}
+
+// steal the first task of victim
+static TaskStruct_t *stealHeapTask(Worker_t *worker, Worker_t *victim) {
+    // don't wait for a busy victim
+    if (!victim->run_heap.size) {
+        return NULL;
+    }
+    return popHeapTask(victim);
+}
+
+static const SchedPolicy_t rr_policy = {
+    .push = pushRingTask, .pop = popRingTask, .steal = stealRingTask, .room = ringRoom, .empty = ringEmpty,
+};
+
+static const SchedPolicy_t priority_policy = {
+    .push = pushHeapTask, .pop = popHeapTask, .steal = stealHeapTask, .room = heapRoom, .empty = heapEmpty,
+    .key = priorityKey,
+};
+
+static const SchedPolicy_t fair_policy = {
+    .push = pushHeapTask, .pop = popHeapTask, .steal = stealHeapTask, .room = heapRoom, .empty = heapEmpty,
+    .key = fairKey, .account = fairAccount,
+};
+
+static void armTimer(Worker_t *worker, uint64_t ns);
+
+// push a task into worker's local run queue, only the owner worker can call it
+static void pushLocalTask(Worker_t *worker, TaskStruct_t *task) {
+    m_sched_t *sched = worker->sched;
+    if (sched->collect_stats) {
+        task->ready_time = getTime();
+    }
+    sched->policy->push(worker, task);
+    // pushed by the running task, it can't wait for the running task to give up the cpu
+    if (!worker->timer_armed && currentTask()) {
+        armTimer(worker, sched->sched_quantum);
+    }
+}
+
+// pop the next task of worker's local run queue, only the owner worker can call it
+// return might be null
+static TaskStruct_t *popLocalTask(Worker_t *worker) {
+    return worker->sched->policy->pop(worker);
+}
+
+// steal tasks of victim, return one of them, might be null. worker's local run queue must be empty
+static TaskStruct_t *stealTask(Worker_t *worker, Worker_t *victim) {
+    return worker->sched->policy->steal(worker, victim);
+}
+
+// how many tasks can be pushed into worker's local run queue, only the owner worker can call it
+static uint32_t localQueueRoom(Worker_t *worker) {
+    return worker->sched->policy->room(worker);
+}
+
+// make a task runnable
+// on a worker of its scheduler, it goes into the local queue, so the caller shall be the worker's scheduler, or a
+// user thread on it with interrupt blocked. otherwise it goes into global task list of its scheduler
+static void readyTask(TaskStruct_t *task) {
+    Worker_t *worker = currentWorker();
+    if (worker && worker->sched == task->sched) {
+        pushLocalTask(worker, task);
+    } else {
+        pushTask(task);
+    }
+}
+
+// wake up a task parked by parkCurrent(), or about to park
+// waking up a running task does nothing
+static void wakeTask(TaskStruct_t *task) {
+    int state = atomic_load(&task->wait_state);
+    while (1) {
+        if (state == TASK_PARKING) {
+            // its scheduler will see it and put it back
+            if (atomic_compare_exchange_weak(&task->wait_state, &state, TASK_NOTIFIED)) {
+                return;
+            }
+        } else if (state == TASK_PARKED) {
+            if (atomic_compare_exchange_weak(&task->wait_state, &state, TASK_RUNNING)) {
+                readyTask(task);
+                return;
+            }
+        } else {
+            return;
+        }
+    }
+}
+
+// park current task until someone calls wakeTask() on it, preemption must be disabled (no_preempt)
+// to not miss a wakeup, the task shall set its wait_state to TASK_PARKING before making itself visible to wakers
+// (e.g., pushing itself into a wait queue), then call this. the scheduler decides whether it actually parks after its
+// context is saved
+static void parkCurrent(TaskStruct_t *current) {
+    switchContext(&current->context, &currentWorker()->schedule_context);
+}
+
+// a cancellation point: exit current thread if it has been canceled
+static void testCancel(TaskStruct_t *current) {
+    if (cancelPending(current)) {
+        m_thread_exit(M_THREAD_CANCELED);
+    }
+}
+
+// wake up sleepers whose time is up on given worker
+static void wakeSleepers(Worker_t *worker) {
+    if (!worker->sleepers.size) {
+        return;
+    }
+    uint64_t now = getTime();
+    spinLock(&worker->sleep_lock);
+    while (worker->sleepers.size && worker->sleepers.entries[0].key <= now) {
+        wakeTask(heapPop(&worker->sleepers));
+    }
+    spinUnlock(&worker->sleep_lock);
+}
+
+// take a canceled task out of worker's sleep heap, return 0 if it is not there
+static int takeSleeper(Worker_t *worker, TaskStruct_t *task) {
+    spinLock(&worker->sleep_lock);
+    int found = heapTake(&worker->sleepers, task);
+    spinUnlock(&worker->sleep_lock);
+    return found;
+}
+
+// CLOCK_MONOTONIC time in ns the scheduler of given worker has something to do at: the earliest sleeper wakes up,
+// or the earliest deadline of any task passes. NO_DEADLINE if none
+static uint64_t nextWakeup(Worker_t *worker) {
+    uint64_t wakeup = atomic_load_explicit(&worker->sched->next_deadline, memory_order_relaxed);
+    if (worker->sleepers.size && worker->sleepers.entries[0].key < wakeup) {
+        wakeup = worker->sleepers.entries[0].key;
+    }
+    return wakeup;
+}
+
+// get state of given fd in fd table of sched, return NULL if fd is invalid or out of memory
+static FdState_t *getFdState(m_sched_t *sched, int fd) {
+    if (fd < 0 || fd >= FD_CHUNK_SIZE * FD_TABLE_SIZE) {
+        errno = EBADF;
+        return NULL;
+    }
+    _Atomic(FdState_t *) *slot = &sched->fd_table[fd / FD_CHUNK_SIZE];
+    FdState_t *chunk = atomic_load(slot);
+    if (!chunk) {
+        FdState_t *new_chunk = calloc(FD_CHUNK_SIZE, sizeof(FdState_t));
+        if (!new_chunk) {
+            errno = ENOMEM;
+            return NULL;
+        }
+        // someone else may allocate it at the same time
+        if (atomic_compare_exchange_strong(slot, &chunk, new_chunk)) {
+            chunk = new_chunk;
+        } else {
+            free(new_chunk);
+        }
+    }
+    return &chunk[fd % FD_CHUNK_SIZE];
+}
+
+// arm fd in epoll of sched for what its waiters want, lock of state must be held
+// fd is armed in one-shot mode, so it must be re-armed every time it fires. it costs a syscall, but survives fd being
+// closed and reused behind our back
+static int armFd(m_sched_t *sched, int fd, FdState_t *state) {
+    uint32_t events = 0;
+    if (state->readers.head) {
+        events |= EPOLLIN | EPOLLRDHUP;
+    }
+    if (state->writers.head) {
+        events |= EPOLLOUT;
+    }
+    if (!events) {
+        return 0;
+    }
+    struct epoll_event event = {.events = events | EPOLLONESHOT, .data.fd = fd};
+    if (epoll_ctl(sched->epoll_fd, EPOLL_CTL_MOD, fd, &event)) {
+        if (errno != ENOENT || epoll_ctl(sched->epoll_fd, EPOLL_CTL_ADD, fd, &event)) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// wake up every task in a fd wait queue, lock of its fd state must be held
+static void wakeFdWaiters(TaskQueue_t *q) {
+    TaskStruct_t *task;
+    while ((task = dequeueTask(q))) {
+        atomic_fetch_sub(&task->sched->io_waiters, 1);
+        wakeTask(task);
+    }
+}
+
+// take a task out of a fd wait queue, lock of its fd state must be held. return 0 if it is not there
+static int takeQueuedTask(TaskQueue_t *q, TaskStruct_t *task) {
+    for (TaskStruct_t *t = q->head; t; t = t->next) {
+        if (t == task) {
+            removeQueuedTask(q, task);
+            atomic_fetch_sub(&task->sched->io_waiters, 1);
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// take a canceled task out of the wait queues of a fd, return 0 if it is not there
+static int takeFdWaiter(FdState_t *state, TaskStruct_t *task) {
+    spinLock(&state->lock);
+    int found = takeQueuedTask(&state->readers, task) || takeQueuedTask(&state->writers, task);
+    spinUnlock(&state->lock);
+    return found;
+}
+
+// queue current task as a waiter of fd for events (POLLIN or POLLOUT), and mark it parking
+// preemption must be disabled (no_preempt). return -1 with errno set if fd can't be waited, ECANCELED if the task
+// has been canceled
+static int queueFdWaiter(TaskStruct_t *current, int fd, short events) {
+    m_sched_t *sched = current->sched;
+    FdState_t *state = getFdState(sched, fd);
+    if (!state) {
+        return -1;
+    }
+    TaskQueue_t *q = events == POLLIN ? &state->readers : &state->writers;
+
+    // see pushSleeper()
+    atomic_store(&current->wait_fd, state);
+    spinLock(&state->lock);
+    if (cancelPending(current)) {
+        spinUnlock(&state->lock);
+        errno = ECANCELED;
+        return -1;
+    }
+    atomic_store(&current->wait_state, TASK_PARKING);
+    enqueueTask(q, current);
+    if (armFd(sched, fd, state)) {
+        // e.g., regular files can't be polled
+        int err = errno;
+        removeQueuedTask(q, current);
+        atomic_store(&current->wait_state, TASK_RUNNING);
+        spinUnlock(&state->lock);
+        errno = err;
+        return -1;
+    }
+    atomic_fetch_add(&sched->io_waiters, 1);
+    spinUnlock(&state->lock);
+    return 0;
+}
+
+// park current thread until fd is ready for events (POLLIN or POLLOUT)
+// outside a thread, block the system thread instead. a coroutine gets EAGAIN, it waits by m_co_wait_read() / write()
+// return -1 with errno set if fd can't be waited
+static int waitFd(int fd, short events) {
+    TaskStruct_t *current = currentTask();
+    if (current && current->step) {
+        errno = EAGAIN;
+        return -1;
+    }
+    if (!current) {
+        struct pollfd pfd = {.fd = fd, .events = events};
+        return poll(&pfd, 1, -1) < 0 ? -1 : 0;
+    }
+
+    current->no_preempt++;
+    if (queueFdWaiter(current, fd, events)) {
+        current->no_preempt--;
+        testCancel(current);
+        return -1;
+    }
+    parkCurrent(current);
+    current->no_preempt--;
+    testCancel(current);
+    return 0;
+}
+
+// fd is ready, wake up its waiters
+static void handleFdEvent(m_sched_t *sched, int fd, uint32_t events) {
+    FdState_t *state = getFdState(sched, fd);
+    if (!state) {
+        return;
+    }
+    spinLock(&state->lock);
+    if (events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR)) {
+        wakeFdWaiters(&state->readers);
+    }
+    if (events & (EPOLLOUT | EPOLLHUP | EPOLLERR)) {
+        wakeFdWaiters(&state->writers);
+    }
+    // still someone waiting for the other direction
+    armFd(sched, fd, state);
+    spinUnlock(&state->lock);
+}
+
+// cancel a task: mark it, and wake it up if it is parked at a cancellation point. the caller holds record_lock or
+// deadline_lock, so the task can't be finished meanwhile
+static void cancelTask(TaskStruct_t *task) {
+    if (atomic_fetch_or(&task->cancel_state, CANCEL_PENDING)) {
+        // canceled already, or exiting
+        return;
+    }
+    Worker_t *worker = atomic_load(&task->sleep_worker);
+    FdState_t *state = atomic_load(&task->wait_fd);
+    if ((worker && takeSleeper(worker, task)) || (state && takeFdWaiter(state, task))) {
+        wakeTask(task);
+        return;
+    }
+    m_sched_t *sched = task->sched;
+    if (task->cancel_type == M_THREAD_CANCEL_ASYNCHRONOUS && sched->started) {
+        // it may be running without a timer, interrupt every worker of its scheduler, the one running it will preempt
+        // it
+        for (unsigned int i = 0; i < sched->n_workers; i++) {
+            if (sched->workers[i].thread) {
+                pthread_kill(sched->workers[i].thread, INTERRUPT_SIGNAL);
+            }
+        }
+    }
+}
+
+// cancel the tasks of sched whose deadlines have passed
+static void expireDeadlines(m_sched_t *sched) {
+    uint64_t now = getTime();
+    spinLock(&sched->deadline_lock);
+    TaskHeap_t *heap = &sched->deadline_heap;
+    while (heap->size && heap->entries[0].key <= now) {
+        TaskStruct_t *task = heapPop(heap);
+        task->deadline = 0;
+        cancelTask(task);
+    }
+    atomic_store(&sched->next_deadline, heap->size ? heap->entries[0].key : NO_DEADLINE);
+    spinUnlock(&sched->deadline_lock);
+}
+
+// take a finished task out of deadline_heap of its scheduler
+static void clearDeadline(TaskStruct_t *task) {
+    m_sched_t *sched = task->sched;
+    spinLock(&sched->deadline_lock);
+    if (task->deadline) {
+        TaskHeap_t *heap = &sched->deadline_heap;
+        heapTake(heap, task);
+        task->deadline = 0;
+        atomic_store(&sched->next_deadline, heap->size ? heap->entries[0].key : NO_DEADLINE);
+    }
+    spinUnlock(&sched->deadline_lock);
+}
+
+// wake up the threads of sched whose offloaded calls have completed
+static void completeOffload(m_sched_t *sched) {
+    // reset it before taking the jobs, so a job completed after that writes it again
+    uint64_t count;
+    if (read(sched->offload_fd, &count, sizeof(count)) < 0) {
+        // another worker has read it
+    }
+    OffloadJob_t *job = atomic_exchange(&sched->offload_done, NULL);
+    while (job) {
+        // the job is gone once its thread runs
+        OffloadJob_t *next = job->next;
+        atomic_fetch_sub(&sched->io_waiters, 1);
+        wakeTask(job->task);
+        job = next;
+    }
+}
+
+// submit the queued requests of a worker's io_uring, only the worker calls it
+static void submitUring(Uring_t *uring) {
+    long n = syscall(__NR_io_uring_enter, uring->fd, uring->pending, 0, 0, NULL, 0);
+    // e.g., interrupted, the rest are submitted next round
+    if (n > 0) {
+        uring->pending -= n;
+    }
+}
+
+// some request of io_uring has completed and is not reaped yet
+static int uringCompleted(Uring_t *uring) {
+    return atomic_load_explicit(uring->cq_head, memory_order_relaxed) !=
+           atomic_load_explicit(uring->cq_tail, memory_order_acquire);
+}
+
+// wake up the threads whose requests on io_uring have completed
+static void reapUring(Uring_t *uring) {
+    spinLock(&uring->lock);
+    unsigned head = atomic_load_explicit(uring->cq_head, memory_order_relaxed);
+    unsigned tail = atomic_load_explicit(uring->cq_tail, memory_order_acquire);
+    for (; head != tail; head++) {
+        struct io_uring_cqe *cqe = &uring->cqes[head & uring->cq_mask];
+        UringOp_t *op = (UringOp_t *)(uintptr_t)cqe->user_data;
+        op->res = cqe->res;
+        atomic_fetch_sub(&uring->inflight, 1);
+        atomic_fetch_sub(&op->task->sched->io_waiters, 1);
+        // the request is gone once its thread runs
+        wakeTask(op->task);
+    }
+    // the kernel may reuse the entries now
+    atomic_store_explicit(uring->cq_head, head, memory_order_release);
+    spinUnlock(&uring->lock);
+}
+
+// submit queued requests of worker's io_uring and reap its completions, called every scheduler round
+// requests are batched: they are submitted by one system call when URING_BATCH of them are queued, the local run
+// queue runs out, or the oldest has waited for POLL_INTERVAL_NS
+static void flushUring(Worker_t *worker) {
+    Uring_t *uring = &worker->uring;
+    if (uring->pending && (uring->pending >= URING_BATCH || worker->sched->policy->empty(worker) ||
+                           getTime() - uring->pending_since >= POLL_INTERVAL_NS)) {
+        // requests served from page cache complete right in the system call, reap them below
+        submitUring(uring);
+    }
+    if (uringCompleted(uring)) {
+        reapUring(uring);
+    }
+}
+
+// wake up the threads whose io_uring requests have completed, on any worker of sched
+static void completeUring(m_sched_t *sched) {
+    // reset it before reaping, so a request completed after that signals it again
+    uint64_t count;
+    if (read(sched->uring_fd, &count, sizeof(count)) < 0) {
+        // another worker has read it
+    }
+    for (unsigned int i = 0; i < sched->n_workers; i++) {
+        if (uringCompleted(&sched->workers[i].uring)) {
+            reapUring(&sched->workers[i].uring);
+        }
+    }
+}
+
+// wait for epoll events at most timeout ns, -1 means forever
+static int waitEvents(Worker_t *worker, struct epoll_event *events, int64_t timeout) {
+#if defined(__GLIBC__) && __GLIBC_PREREQ(2, 35)
+    // epoll_pwait2() takes ns, so a short wait still returns as soon as I/O or an offloaded call completes
+    static _Atomic int no_pwait2;
+    if (!atomic_load_explicit(&no_pwait2, memory_order_relaxed)) {
+        struct timespec ts = {.tv_sec = timeout / 1000000000, .tv_nsec = timeout % 1000000000};
+        // timer interrupt is useless while waiting, don't let it cut the wait short
+        int n = epoll_pwait2(worker->sched->epoll_fd, events, MAX_EVENTS, timeout < 0 ? NULL : &ts, &worker->idle_mask);
+        if (n >= 0 || errno != ENOSYS) {
+            return n;
+        }
+        atomic_store_explicit(&no_pwait2, 1, memory_order_relaxed);
+    }
+#endif
+    // epoll_pwait() counts in ms, sleep the rest of sub-ms timeout without polling
+    int n = epoll_pwait(worker->sched->epoll_fd, events, MAX_EVENTS, timeout < 0 ? -1 : (int)(timeout / 1000000),
+                        &worker->idle_mask);
+    if (n == 0 && timeout > 0 && timeout < 1000000) {
+        struct timespec ts = {.tv_nsec = timeout};
+        nanosleep(&ts, NULL);
+    }
+    return n;
+}
+
+// handle I/O readiness and idle wakeups, wait at most timeout ns for them, -1 means forever
+static void pollIO(Worker_t *worker, int64_t timeout) {
+    m_sched_t *sched = worker->sched;
+    struct epoll_event events[MAX_EVENTS];
+    int n = waitEvents(worker, events, timeout);
+    worker->last_poll = getTime();
+    for (int i = 0; i < n; i++) {
+        if (events[i].data.fd == sched->offload_fd) {
+            completeOffload(sched);
+            continue;
+        }
+        if (events[i].data.fd == sched->uring_fd) {
+            completeUring(sched);
+            continue;
+        }
+        if (events[i].data.fd == sched->wake_fd) {
+            // when all tasks finish, leave it readable, so every idle worker wakes up and exits
+            if (atomic_load(&sched->live_tasks)) {
+                uint64_t count;
+                if (read(sched->wake_fd, &count, sizeof(count)) > 0) {
+                    atomic_store(&sched->wake_pending, 0);
+                }
+            }
+            continue;
+        }
+        handleFdEvent(sched, events[i].data.fd, events[i].events);
+    }
+}
+
+// check if there is a runnable task in any run queue of sched
+static int hasRunnableTask(m_sched_t *sched) {
+    // the caller has just been counted as idle, order it before the loads below, see notifyIdleWorker()
+    atomic_thread_fence(memory_order_seq_cst);
+    if (atomic_load(&sched->task_list_size)) {
+        return 1;
+    }
+    for (unsigned int i = 0; i < sched->n_workers; i++) {
+        if (!sched->policy->empty(&sched->workers[i])) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static void flushLog(Worker_t *worker);
+
+// nothing to run on given worker, wait until a task becomes runnable, or I/O is ready, or the earliest sleeper wakes up
+static void idle(Worker_t *worker) {
+    if (worker->log_len) {
+        flushLog(worker);
+    }
+    m_sched_t *sched = worker->sched;
+    atomic_fetch_add(&sched->idle_workers, 1);
+    // a task might be pushed right before this worker is counted as idle, see notifyIdleWorker()
+    if (atomic_load(&sched->live_tasks) && !hasRunnableTask(sched)) {
+        int64_t timeout = -1;
+        uint64_t wakeup = nextWakeup(worker);
+        if (wakeup != NO_DEADLINE) {
+            uint64_t now = getTime();
+            timeout = wakeup > now ? wakeup - now : 0;
+        }
+        pollIO(worker, timeout);
+    }
+    atomic_fetch_sub(&sched->idle_workers, 1);
+}
+
+// get next task to execute on given worker
+// return might be null
+// basically round-robin: local queue first, then global task list, then steal from other workers
+static TaskStruct_t *getNextTask(Worker_t *worker) {
+    TaskStruct_t *task;
+    worker->tick++;
+    if (worker->tick % GLOBAL_QUEUE_INTERVAL == 0 && (task = popTask(worker))) {
+        return task;
+    }
+    if ((task = popLocalTask(worker))) {
+        return task;
+    }
+    if ((task = popTask(worker))) {
+        return task;
+    }
+    m_sched_t *sched = worker->sched;
+    for (unsigned int i = 1; i < sched->n_workers; i++) {
+        Worker_t *victim = &sched->workers[(worker->index + worker->tick + i) % sched->n_workers];
+        if (victim != worker && (task = stealTask(worker, victim))) {
+            return task;
+        }
+    }
+    return NULL;
+}
+
+// --- memory ---
+
+// tag of an updated head, in its upper half
+static uint64_t nextIndexHead(uint64_t head, uint32_t index) {
+    return ((head >> 32) + 1) << 32 | index;
+}
+
+// push index onto stack, link is where index keeps the one below it
+static void indexPush(IndexStack_t *stack, uint32_t index, _Atomic uint32_t *link) {
+    uint64_t head = atomic_load(stack);
+    do {
+        atomic_store_explicit(link, (uint32_t)head, memory_order_relaxed);
+    } while (!atomic_compare_exchange_weak(stack, &head, nextIndexHead(head, index)));
+}
+
+// pop an index from stack, INDEX_NONE if it is empty. link(owner, index) is where index keeps the one below it, which
+// must stay readable after index is popped by someone else
+static uint32_t indexPop(IndexStack_t *stack, _Atomic uint32_t *(*link)(void *owner, uint32_t index), void *owner) {
+    uint64_t head = atomic_load(stack);
+    while (1) {
+        uint32_t index = (uint32_t)head;
+        if (index == INDEX_NONE) {
+            return INDEX_NONE;
+        }
+        uint32_t next = atomic_load_explicit(link(owner, index), memory_order_relaxed);
+        if (atomic_compare_exchange_weak(stack, &head, nextIndexHead(head, next))) {
+            return index;
+        }
+    }
+}
+
+static _Atomic uint32_t *stackSlotLink(void *owner, uint32_t index) {
+    return &stack_slot_links[index];
+}
+
+static _Atomic uint32_t *poolLink(void *owner, uint32_t index) {
+    Pool_t *pool = owner;
+    char *slab = pool->slabs[index >> 16];
+    return (_Atomic uint32_t *)(slab + (size_t)pool->slab_objects * pool->object_size) + (index & 0xffff);
+}
+
+// map a new slab, and push its objects into the free list
+static int growPool(Pool_t *pool) {
+    spinLock(&pool->grow_lock);
+    // someone else has just grown it
+    if ((uint32_t)atomic_load(&pool->free) != INDEX_NONE) {
+        spinUnlock(&pool->grow_lock);
+        return 0;
+    }
+    uint32_t n = atomic_load(&pool->slab_count);
+    char *slab = n < POOL_MAX_SLABS ? mmap(NULL, POOL_SLAB_SIZE, PROT_READ | PROT_WRITE,
+                                           MAP_PRIVATE | MAP_ANONYMOUS, -1, 0) : MAP_FAILED;
+    if (slab == MAP_FAILED) {
+        spinUnlock(&pool->grow_lock);
+        errno = ENOMEM;
+        return -1;
+    }
+    if (!n) {
+        size_t objects = POOL_SLAB_SIZE / (pool->object_size + sizeof(uint32_t));
+        pool->slab_objects = objects < 0x10000 ? objects : 0x10000;
+    }
+    pool->slabs[n] = slab;
+    atomic_store(&pool->slab_count, n + 1);
+    for (uint32_t i = pool->slab_objects; i-- > 0;) {
+        uint32_t index = n << 16 | i;
+        indexPush(&pool->free, index, poolLink(pool, index));
+    }
+    spinUnlock(&pool->grow_lock);
+    return 0;
+}
+
+// take an object from pool, store its index in *index. return NULL if out of memory
+static void *poolAlloc(Pool_t *pool, uint32_t *index) {
+    while (1) {
+        uint32_t i = indexPop(&pool->free, poolLink, pool);
+        if (i != INDEX_NONE) {
+            *index = i;
+            return pool->slabs[i >> 16] + (size_t)(i & 0xffff) * pool->object_size;
+        }
+        if (growPool(pool)) {
+            return NULL;
+        }
+    }
+}
+
+// give an object back to pool
+static void poolFree(Pool_t *pool, uint32_t index) {
+    indexPush(&pool->free, index, poolLink(pool, index));
+}
+
+// a record from record_pool
+static ThreadRecord_t *allocateRecord() {
+    uint32_t index;
+    ThreadRecord_t *record = poolAlloc(&record_pool, &index);
+    if (record) {
+        record->pool_index = index;
+    }
+    return record;
+}
+
+static void freeRecord(ThreadRecord_t *record) {
+    if (record) {
+        poolFree(&record_pool, record->pool_index);
+    }
+}
+
+static size_t roundToPage(size_t size) {
+    size_t page = (size_t)sysconf(_SC_PAGESIZE);
+    return (size + page - 1) & ~(page - 1);
+}
+
+// size of the whole mapping of a task created with current settings
+static size_t stackMappingSize() {
+    return roundToPage(stack_guard_size) + roundToPage(stack_size + sizeof(TaskStruct_t));
+}
+
+// map a stack with current settings, the task lives at its top
+// memory is committed lazily (MAP_NORESERVE), an idle thread only costs the pages it has touched
+static TaskStruct_t *mapTask() {
+    size_t length = stackMappingSize();
+    size_t guard = roundToPage(stack_guard_size);
+    char *base = mmap(NULL, length, PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_STACK, -1, 0);
+    if (base == MAP_FAILED) {
+        return NULL;
+    }
+    // stack overflow hits the guard instead of other memory
+    if (guard && mprotect(base, guard, PROT_NONE)) {
+        munmap(base, length);
+        return NULL;
+    }
+
+    TaskStruct_t *task = (TaskStruct_t *)(((uintptr_t)base + length - sizeof(TaskStruct_t)) & ~(uintptr_t)63);
+    task->stack = base;
+    task->stack_size = length;
+    task->guard_size = guard;
+    return task;
+}
+
+// the stack of task is what current settings would map
+static int stackFits(TaskStruct_t *task) {
+    return task->stack_size == stackMappingSize() && task->guard_size == roundToPage(stack_guard_size);
+}
+
+// release the task and its stack, or keep them for reuse
+static void freeTask(TaskStruct_t *task) {
+    if (!task->stack) {
+        // a coroutine
+        poolFree(&coroutine_pool, task->pool_index);
+        return;
+    }
+    if (stackFits(task)) {
+        uint32_t slot = indexPop(&free_stack_slots, stackSlotLink, NULL);
+        if (slot == INDEX_NONE && atomic_load(&stack_slots_used) < STACK_CACHE_SIZE) {
+            slot = atomic_fetch_add(&stack_slots_used, 1);
+            if (slot >= STACK_CACHE_SIZE) {
+                slot = INDEX_NONE;
+            }
+        }
+        if (slot != INDEX_NONE) {
+            stack_slots[slot] = task;
+            indexPush(&cached_stacks, slot, &stack_slot_links[slot]);
+            return;
+        }
+    }
+    // the task is inside the mapping
+    munmap(task->stack, task->stack_size);
+}
+
+// take a task from stack cache, NULL if it is empty
+static TaskStruct_t *popStackCache() {
+    uint32_t slot = indexPop(&cached_stacks, stackSlotLink, NULL);
+    if (slot == INDEX_NONE) {
+        return NULL;
+    }
+    TaskStruct_t *task = stack_slots[slot];
+    indexPush(&free_stack_slots, slot, &stack_slot_links[slot]);
+    return task;
+}
+
+// unmap every cached stack
+static void releaseStackCache() {
+    TaskStruct_t *task;
+    while ((task = popStackCache())) {
+        munmap(task->stack, task->stack_size);
+    }
+}
+
+// find the slot holding the record of thread in record table, NULL if there is none. record_lock shall be held
+static ThreadRecord_t **findRecord(m_thread_t thread) {
+    if (!record_table) {
+        return NULL;
+    }
+    ThreadRecord_t **slot = &record_table[thread & (record_table_size - 1)];
+    while (*slot && (*slot)->thread_id != thread) {
+        slot = &(*slot)->next;
+    }
+    return *slot ? slot : NULL;
+}
+
+// add a record to record table, grow it if it is full. record_lock shall be held
+static int insertRecord(ThreadRecord_t *record) {
+    if (record_count >= record_table_size) {
+        size_t size = record_table_size ? record_table_size * 2 : RECORD_TABLE_INIT_SIZE;
+        // mapped rather than malloc()'d, so creating a thread never calls malloc()
+        ThreadRecord_t **table = mmap(NULL, size * sizeof(ThreadRecord_t *), PROT_READ | PROT_WRITE,
+                                      MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (table == MAP_FAILED) {
+            return -1;
+        }
+        for (size_t i = 0; i < record_table_size; i++) {
+            ThreadRecord_t *r = record_table[i];
+            while (r) {
+                ThreadRecord_t *next = r->next;
+                r->next = table[r->thread_id & (size - 1)];
+                table[r->thread_id & (size - 1)] = r;
+                r = next;
+            }
+        }
+        if (record_table) {
+            munmap(record_table, record_table_size * sizeof(ThreadRecord_t *));
+        }
+        record_table = table;
+        record_table_size = size;
+    }
+    ThreadRecord_t **bucket = &record_table[record->thread_id & (record_table_size - 1)];
+    record->next = *bucket;
+    *bucket = record;
+    record_count++;
+    return 0;
+}
+
+// remove the record in slot from record table. record_lock shall be held
+static void removeRecord(ThreadRecord_t **slot) {
+    *slot = (*slot)->next;
+    record_count--;
+}
+
+static void userThreadStart();
+
+static void initTask(TaskStruct_t *task);
+
+// make the context of a thread start from entry on an empty stack
+static int startContext(TaskStruct_t *task, void (*entry)(void)) {
+    // stack is between the guard and the task
+    char *stack = task->stack + task->guard_size;
+    return makeContext(&task->context, stack, (char *)task - stack, entry);
+}
+
+// allocate a task from stack cache or a new mapping, and prepare its context
+static TaskStruct_t *allocateTask() {
+    TaskStruct_t *task;
+    // settings may have changed since it was cached
+    while ((task = popStackCache()) && !stackFits(task)) {
+        munmap(task->stack, task->stack_size);
+    }
+    if (!task) {
+        task = mapTask();
+        if (!task) {
+            return NULL;
+        }
+    }
+    initTask(task);
+    if (startContext(task, userThreadStart)) {
+        freeTask(task);
+        return NULL;
+    }
+    return task;
+}
+
+// allocate a task of a coroutine, it has no stack
+static TaskStruct_t *allocateCoroutine() {
+    uint32_t index;
+    TaskStruct_t *task = poolAlloc(&coroutine_pool, &index);
+    if (!task) {
+        return NULL;
+    }
+    task->pool_index = index;
+    task->stack = NULL;
+    task->stack_size = 0;
+    task->guard_size = 0;
+    initTask(task);
+    return task;
+}
+
+// reset the fields of a new task
+static void initTask(TaskStruct_t *task) {
+    task->thread_id = -1;
+    // switched out before it starts
+    task->no_preempt = 1;
+    task->exited = 0;
+    task->prev = NULL;
+    task->next = NULL;
+    task->wait_state = TASK_RUNNING;
+    task->wake_time = 0;
+    task->priority = 0;
+    task->weight = DEFAULT_WEIGHT;
+    task->quantum = 0;
+    task->vruntime = 0;
+    task->dispatch_time = 0;
+    task->preempted = 0;
+    task->ready_time = 0;
+    memset(&task->stats, 0, sizeof(task->stats));
+    task->step = NULL;
+    memset(task->specific, 0, sizeof(task->specific));
+    task->cancel_state = 0;
+    task->cancel_type = M_THREAD_CANCEL_DEFERRED;
+    task->sleep_worker = NULL;
+    task->wait_fd = NULL;
+    task->killable = 0;
+    task->deadline = 0;
+    task->group = NULL;
+    task->sched = NULL;
+}
+
+// task has returned, free it
+static void leaveGroup(m_task_group_t *group);
+
+static void finishTask(TaskStruct_t *task) {
+    m_sched_t *sched = task->sched;
+    if (task->deadline) {
+        clearDeadline(task);
+    }
+    if (task->group) {
+        leaveGroup(task->group);
+    }
+    ThreadRecord_t *record = task->record;
+    TaskStruct_t *joiner = NULL;
+    spinLock(&record_lock);
+    if (record->detached) {
+        // nobody cares about it
+        removeRecord(findRecord(record->thread_id));
+    } else {
+        record->exited = 1;
+        record->task = NULL;
+        record->stats = task->stats;
+        joiner = record->joiner;
+        record = NULL;
+    }
+    spinUnlock(&record_lock);
+    freeRecord(record);
+    if (joiner) {
+        wakeTask(joiner);
+    }
+
+    freeTask(task);
+    if (atomic_fetch_sub(&sched->live_tasks, 1) == 1) {
+        // the last one, wake up idle workers to exit
+        uint64_t one = 1;
+        if (write(sched->wake_fd, &one, sizeof(one)) < 0) {
+            perror("write wake_fd failed in finishTask");
+        }
+    }
+}
+
+// time slice of a task
+static uint64_t taskQuantum(TaskStruct_t *task) {
+    return task->quantum ? task->quantum : task->sched->sched_quantum;
+}
+
+// arm worker's timer to fire in ns, or earlier if a sleeper wakes up or a deadline passes earlier
+static void armTimer(Worker_t *worker, uint64_t ns) {
+    uint64_t now = getTime();
+    uint64_t wakeup = nextWakeup(worker);
+    if (wakeup < now + ns) {
+        ns = wakeup > now ? wakeup - now : 0;
+    }
+    if (ns < MIN_TIMER_NS) {
+        ns = MIN_TIMER_NS;
+    }
+    struct itimerspec spec = {.it_value = {.tv_sec = ns / 1000000000, .tv_nsec = ns % 1000000000}};
+    worker->timer_deadline = now + ns;
+    worker->armed_seq = worker->dispatch_seq;
+    worker->timer_armed = 1;
+    timer_settime(worker->timer, 0, &spec, NULL);
+}
+
+// other tasks want this worker, so the running task shall be preempted when its time slice is used up
+static int needTimer(Worker_t *worker) {
+    m_sched_t *sched = worker->sched;
+    return !sched->policy->empty(worker) || atomic_load_explicit(&sched->task_list_size, memory_order_relaxed) ||
+           nextWakeup(worker) != NO_DEADLINE || atomic_load_explicit(&sched->io_waiters, memory_order_relaxed);
+}
+
+// called before next is switched in. the timer is armed only if it is needed and not armed yet, so most dispatches
+// take no system call: a timer armed for the previous task is checked by timerInterrupt(), which extends it for next
+static void prepareTimer(Worker_t *worker, TaskStruct_t *next) {
+    worker->dispatch_seq++;
+    if (worker->timer_armed) {
+        // a sleeper wakes up or a deadline passes earlier, or next has a shorter time slice than the armed one
+        int earlier = nextWakeup(worker) < worker->timer_deadline;
+        if (!earlier && (!next->quantum || next->quantum >= worker->sched->sched_quantum)) {
+            return;
+        }
+    } else if (!needTimer(worker)) {
+        // nothing else to run, let it run without interruption
+        return;
+    }
+    armTimer(worker, taskQuantum(next));
+}
+
+// the task has been switched out, count how its time slice ended, and charge it for the time slice if measured
+// return how it ended
+static int accountTask(Worker_t *worker, TaskStruct_t *task, uint64_t dispatch_time) {
+    int reason;
+    if (task->exited) {
+        reason = SLICE_EXITED;
+    } else if (atomic_load_explicit(&task->wait_state, memory_order_relaxed) != TASK_RUNNING) {
+        reason = SLICE_PARKED;
+        task->stats.parks++;
+    } else if (task->preempted) {
+        reason = SLICE_PREEMPTED;
+        task->stats.preemptions++;
+    } else {
+        reason = SLICE_YIELDED;
+        task->stats.yields++;
+    }
+    task->preempted = 0;
+    if (!dispatch_time) {
+        return reason;
+    }
+
+    m_sched_t *sched = worker->sched;
+    uint64_t now = getTime();
+    if (sched->policy->account) {
+        sched->policy->account(task, now - dispatch_time);
+    }
+    if (sched->collect_stats) {
+        task->stats.cpu_time_ns += now - dispatch_time;
+    }
+    if (sched->trace_rings) {
+        TraceRing_t *ring = &sched->trace_rings[worker->index];
+        TraceEvent_t *event = &ring->events[ring->count++ % sched->trace_size];
+        event->thread_id = task->thread_id;
+        event->start = dispatch_time;
+        event->end = now;
+        event->reason = reason;
+    }
+    return reason;
+}
+
+static void destroySpecific(TaskStruct_t *task);
+
+// run a step of a coroutine on scheduler's stack, when it returns, the coroutine is like a switched out thread
+static void runCoroutine(TaskStruct_t *task) {
+    if (cancelPending(task)) {
+        // it is not waiting for anything now
+        task->record->result = M_THREAD_CANCELED;
+        destroySpecific(task);
+        task->exited = 1;
+        return;
+    }
+    // M_CO_READY: yielded, its wait_state is TASK_RUNNING. M_CO_WAIT: a m_co_wait_*() call has marked it parking
+    if (task->step(task->arg) == M_CO_DONE) {
+        destroySpecific(task);
+        task->exited = 1;
+    }
+}
+
+static void canceledThreadStart();
+
+// drop the stack of a thread canceled asynchronously when it is switched in, or have it preempted soon if its context
+// can't be dropped
+static void killTask(Worker_t *worker, TaskStruct_t *task) {
+    if (task->killable && !startContext(task, canceledThreadStart)) {
+        return;
+    }
+    armTimer(worker, MIN_TIMER_NS);
+}
+
+static void schedule(Worker_t *worker) {
+    m_sched_t *sched = worker->sched;
+    while (1) {
+        wakeSleepers(worker);
+        uint64_t deadline = atomic_load_explicit(&sched->next_deadline, memory_order_relaxed);
+        if (deadline != NO_DEADLINE && deadline <= getTime()) {
+            expireDeadlines(sched);
+        }
+        if (sched->use_uring) {
+            flushUring(worker);
+        }
+        // don't let I/O waiters starve behind a busy run queue
+        if (atomic_load(&sched->io_waiters) && getTime() - worker->last_poll >= POLL_INTERVAL_NS) {
+            pollIO(worker, 0);
+        }
+        TaskStruct_t *next = getNextTask(worker);
+        if (!next) {
+            if (!atomic_load(&sched->live_tasks)) {
+                return;
+            }
+            // remaining tasks are sleeping, waiting for I/O or running on other workers
+            idle(worker);
+            continue;
+        }
+
+        // a pending preemption of the last time slice is satisfied now
+        next->preempt_pending = 0;
+        uint64_t dispatch_time = 0;
+        if (sched->track_runtime) {
+            dispatch_time = next->dispatch_time = getTime();
+        }
+        if (sched->collect_stats && next->ready_time) {
+            next->stats.wait_time_ns += dispatch_time - next->ready_time;
+        }
+        next->stats.switches++;
+        prepareTimer(worker, next);
+        local_task = next;
+        if (next->cancel_type == M_THREAD_CANCEL_ASYNCHRONOUS && cancelPending(next)) {
+            killTask(worker, next);
+        }
+        // printf("[Enter thread %lu]\n", next->thread_id);
+        if (next->step) {
+            runCoroutine(next);
+        } else {
+            switchContext(&worker->schedule_context, &next->context);
+        }
+        // back from thread context: timer interrupt, yield, park, or the task has returned
+        local_task = NULL;
+        next->killable = accountTask(worker, next, dispatch_time) == SLICE_PREEMPTED;
+        if (next->killable && worker->log_len) {
+            // so the log of a busy worker is written at least once per time slice
+            flushLog(worker);
+        }
+
+        if (next->exited) {
+            finishTask(next);
+            continue;
+        }
+        // yielded or preempted, wakers never touch a running task
+        if (atomic_load_explicit(&next->wait_state, memory_order_relaxed) == TASK_RUNNING) {
+            pushLocalTask(worker, next);
+            continue;
+        }
+        // its context is saved now, it is safe to let wakers push it into a run queue
+        int state = TASK_PARKING;
+        if (!atomic_compare_exchange_strong(&next->wait_state, &state, TASK_PARKED)) {
+            // woken up before parking, put it back
+            atomic_store(&next->wait_state, TASK_RUNNING);
+            pushLocalTask(worker, next);
+        }
+    }
+}
+
+// time slice left for current task when worker's timer fires, 0 if it shall be preempted now
+static uint64_t remainingQuantum(Worker_t *worker, TaskStruct_t *current) {
+    uint64_t quantum = taskQuantum(current);
+    uint64_t now = 0;
+    uint64_t wakeup = nextWakeup(worker);
+    int track_runtime = worker->sched->track_runtime;
+    if (track_runtime || wakeup != NO_DEADLINE) {
+        now = getTime();
+    }
+    if (wakeup <= now) {
+        // let the scheduler wake the sleeper up, or cancel the task
+        return 0;
+    }
+    if (track_runtime) {
+        uint64_t ran = now - current->dispatch_time;
+        return ran < quantum ? quantum - ran : 0;
+    }
+    // the timer was armed for a previous task, current one has run for less than the interval since then
+    return worker->armed_seq != worker->dispatch_seq ? quantum : 0;
+}
+
+static void timerInterrupt(int sig, siginfo_t *info, void *ucontext) {
+    Worker_t *worker = currentWorker();
+    TaskStruct_t *current = currentTask();
+    if (!worker) {
+        return;
+    }
+    // otherwise sent by pthread_kill() for asynchronous cancellation, the timer is still armed if it was
+    int expired = info->si_code == SI_TIMER;
+    if (expired) {
+        worker->timer_armed = 0;
+    }
+    // in scheduler, it arms the timer again if needed
+    if (!current) {
+        return;
+    }
+
+    // errno belongs to the system thread
+    int saved_errno = errno;
+    // canceled asynchronously, preempt it now so the scheduler drops it
+    int kill = current->cancel_type == M_THREAD_CANCEL_ASYNCHRONOUS && cancelPending(current);
+    if (!kill && (!expired || !needTimer(worker))) {
+        // cancellation of another task, or nothing else to run, let it run
+        errno = saved_errno;
+        return;
+    }
+    uint64_t remaining = kill ? 0 : remainingQuantum(worker, current);
+    if (remaining) {
+        armTimer(worker, remaining);
+        errno = saved_errno;
+        return;
+    }
+    // in the middle of a context switch, or a critical section: let m_thread_preempt_enable() yield later
+    if (current->no_preempt) {
+        current->preempt_pending = 1;
+        if (kill) {
+            // it may not leave the critical section by m_thread_preempt_enable(), try again soon
+            armTimer(worker, MIN_TIMER_NS);
+        }
+        errno = saved_errno;
+        return;
+    }
+
+    // printf("[Timer interrupt %lu]\n", current->thread_id);
+
+    current->no_preempt = 1;
+    current->preempted = 1;
+    // switch to scheduler context
+    switchContext(&current->context, &currentWorker()->schedule_context);
+    // back from scheduler context (maybe of another worker), continue execution
+    current->no_preempt = 0;
+    errno = saved_errno;
+}
+
+// entry of every user thread
+static void userThreadStart() {
+    // switched out tasks can't be preempted, so it can't be moved to other workers until no_preempt is cleared
+    TaskStruct_t *current = currentTask();
+    current->no_preempt = 0;
+    // canceled before it starts
+    testCancel(current);
+    current->func(current->arg);
+    m_thread_exit(NULL);
+}
+
+// entry of a thread canceled asynchronously, its old stack is dropped
+static void canceledThreadStart() {
+    TaskStruct_t *current = currentTask();
+    current->no_preempt = 0;
+    m_thread_exit(M_THREAD_CANCELED);
+}
+
+static void installTimer(Worker_t *worker) {
+    // the signal shall be delivered to the worker itself
+    struct sigevent sev = {.sigev_signo = INTERRUPT_SIGNAL, .sigev_notify = SIGEV_THREAD_ID};
+    sev.sigev_notify_thread_id = gettid();
+    // monotonic, so it can be armed for the wake up time of a sleeper. it is armed by prepareTimer()
+    if (timer_create(CLOCK_MONOTONIC, &sev, &worker->timer)) {
+        perror("timer create failed in installTimer");
+    }
+    worker->timer_armed = 0;
+}
+
+static void uninstallTimer(Worker_t *worker) {
+    if (timer_delete(worker->timer)) {
+        perror("timer delete failed in uninstallTimer");
+    }
+    // drop the signal that might be still pending, or it kills the process after the handler is uninstalled
+    sigset_t set;
+    sigemptyset(&set);
+    sigaddset(&set, INTERRUPT_SIGNAL);
+    struct timespec zero = {0};
+    while (sigtimedwait(&set, NULL, &zero) > 0);
+}
+
+// number of schedulers running, the interrupt handler is installed while it is not 0
+static unsigned int running_scheds;
+static pthread_mutex_t running_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void installInterruptHandler() {
+    pthread_mutex_lock(&running_lock);
+    if (running_scheds++ == 0) {
+        struct sigaction action = {0};
+        action.sa_sigaction = timerInterrupt;
+        // the handler may not return for a long time (until the task is resumed), and may finish on another worker,
+        // so it shall not block the signal. being interrupted in the middle of it is handled by no_preempt
+        action.sa_flags = SA_RESTART | SA_NODEFER | SA_SIGINFO;
+        sigaction(INTERRUPT_SIGNAL, &action, NULL);
+    }
+    pthread_mutex_unlock(&running_lock);
+}
+
+static void uninstallInterruptHandler() {
+    pthread_mutex_lock(&running_lock);
+    if (--running_scheds == 0) {
+        struct sigaction action = {0};
+        action.sa_handler = SIG_DFL;
+        sigaction(INTERRUPT_SIGNAL, &action, NULL);
+    }
+    pthread_mutex_unlock(&running_lock);
+}
+
+static void unblockInterrupt() {
+    sigset_t set;
+    sigprocmask(SIG_SETMASK, NULL, &set);
+    sigdelset(&set, INTERRUPT_SIGNAL);
+    sigprocmask(SIG_SETMASK, &set, NULL);
+}
+
+void m_thread_preempt_disable() {
+    TaskStruct_t *current = currentTask();
+    if (current) {
+        current->no_preempt++;
+    }
+}
+
+void m_thread_preempt_enable() {
+    // the task can't be moved to other workers while no_preempt is set, so it is still current
+    TaskStruct_t *current = currentTask();
+    if (!current) {
+        return;
+    }
+    if (--current->no_preempt == 0 && current->preempt_pending) {
+        // its time slice was used up in the critical section
+        current->preempt_pending = 0;
+        current->preempted = 1;
+        // yield without a cancellation point, the caller may be in the middle of something
+        current->no_preempt++;
+        switchContext(&current->context, &currentWorker()->schedule_context);
+        current->no_preempt--;
+    }
+}
+
+m_thread_t m_thread_self() {
+    TaskStruct_t *current = currentTask();
+    return current ? current->thread_id : -1;
+}
+
+int m_thread_yield() {
+    TaskStruct_t *current = currentThread();
+    if (!current) {
+        // not in a thread
+        return -1;
+    }
+
+    // printf("[Thread %lld]yield\n", current->thread_id);
+    testCancel(current);
+    current->no_preempt++;
+    // go back to scheduler
+    switchContext(&current->context, &currentWorker()->schedule_context);
+    // return from scheduler
+    current->no_preempt--;
+    testCancel(current);
+    return 0;
+}
+
+void m_thread_exit(void *result) {
+    TaskStruct_t *current = currentThread();
+    if (!current) {
+        return;
+    }
+
+    // destructors may reach cancellation points
+    atomic_fetch_or(&current->cancel_state, CANCEL_DISABLED);
+    destroySpecific(current);
+    // the record can't go away before the task is finished
+    current->record->result = result;
+    // the task may be on another worker now
+    current->no_preempt = 1;
+    current->exited = 1;
+    switchContext(&current->context, &currentWorker()->schedule_context);
+    fprintf(stderr, "[Bug: exited task %lld resumed]\n", current->thread_id);
+    abort();
+}
+
+int m_thread_join(m_thread_t thread, void **result) {
+    TaskStruct_t *current = currentThread();
+    if (current && current->thread_id == thread) {
+        errno = EDEADLK;
+        return -1;
+    }
+
+    m_thread_preempt_disable();
+    spinLock(&record_lock);
+    ThreadRecord_t **slot = findRecord(thread);
+    if (!slot || (*slot)->detached || (*slot)->joiner) {
+        spinUnlock(&record_lock);
+        m_thread_preempt_enable();
+        errno = slot ? EINVAL : ESRCH;
+        return -1;
+    }
+    if (!(*slot)->exited) {
+        if (!current) {
+            // outside a thread, nothing can run while waiting
+            spinUnlock(&record_lock);
+            m_thread_preempt_enable();
+            errno = EBUSY;
+            return -1;
+        }
+        // finishTask() wakes it up
+        (*slot)->joiner = current;
+        atomic_store(&current->wait_state, TASK_PARKING);
+        spinUnlock(&record_lock);
+        parkCurrent(current);
+        spinLock(&record_lock);
+        // the table may have grown
+        slot = findRecord(thread);
+    }
+    ThreadRecord_t *record = *slot;
+    removeRecord(slot);
+    spinUnlock(&record_lock);
+
+    if (result) {
+        *result = record->result;
+    }
+    freeRecord(record);
+    m_thread_preempt_enable();
+    return 0;
+}
+
+int m_thread_detach(m_thread_t thread) {
+    m_thread_preempt_disable();
+    spinLock(&record_lock);
+    ThreadRecord_t **slot = findRecord(thread);
+    if (!slot || (*slot)->detached || (*slot)->joiner) {
+        spinUnlock(&record_lock);
+        m_thread_preempt_enable();
+        errno = slot ? EINVAL : ESRCH;
+        return -1;
+    }
+    ThreadRecord_t *record = NULL;
+    if ((*slot)->exited) {
+        record = *slot;
+        removeRecord(slot);
+    } else {
+        // finishTask() frees it
+        (*slot)->detached = 1;
+    }
+    spinUnlock(&record_lock);
+    freeRecord(record);
+    m_thread_preempt_enable();
+    return 0;
+}
+
+void m_thread_sleep(unsigned long long sec) {
+    m_thread_usleep(sec * 1000000);
+}
+
+void m_thread_usleep(unsigned long long us) {
+    TaskStruct_t *current = currentThread();
+    if (!current) {
+        // not in a thread, sleep the system thread
+        usleep(us);
+        return;
+    }
+
+    // park in the sleep heap of current worker, its scheduler wakes it up when time is up
+    current->no_preempt++;
+    current->wake_time = getTime() + us * 1000;
+    atomic_store(&current->wait_state, TASK_PARKING);
+    int ret = pushSleeper(currentWorker(), current);
+    if (ret < 0) {
+        // out of memory, fall back to yield until time is up
+        atomic_store(&current->wait_state, TASK_RUNNING);
+        while (getTime() < current->wake_time && !cancelPending(current)) {
+            switchContext(&current->context, &currentWorker()->schedule_context);
+        }
+    } else if (ret > 0) {
+        atomic_store(&current->wait_state, TASK_RUNNING);
+    } else {
+        parkCurrent(current);
+    }
+    current->no_preempt--;
+    testCancel(current);
+}
+
+// switch fd to non-blocking mode, so it won't block the worker
+static int setNonBlocking(int fd) {
+    int flags = fcntl(fd, F_GETFL);
+    if (flags < 0) {
+        return -1;
+    }
+    if (!(flags & O_NONBLOCK) && fcntl(fd, F_SETFL, flags | O_NONBLOCK)) {
+        return -1;
+    }
+    return 0;
+}
+
+// run a file I/O request on io_uring of current worker, current thread is parked until it completes
+// return 0 with result of the request in res (-1 with errno set if it fails), or -1 if io_uring can't take it, so the
+// caller does it another way
+static int uringIO(uint8_t opcode, int fd, void *buf, size_t count, off_t offset, ssize_t *res) {
+    TaskStruct_t *current = currentThread();
+    if (!current || !current->sched->use_uring) {
+        return -1;
+    }
+
+    testCancel(current);
+    UringOp_t op = {.task = current};
+    current->no_preempt++;
+    // it stays on this worker until it parks
+    Uring_t *uring = &currentWorker()->uring;
+    unsigned tail = atomic_load_explicit(uring->sq_tail, memory_order_relaxed);
+    if (tail - atomic_load_explicit(uring->sq_head, memory_order_acquire) == uring->sq_entries) {
+        submitUring(uring);
+    }
+    if (tail - atomic_load_explicit(uring->sq_head, memory_order_acquire) == uring->sq_entries ||
+        atomic_load(&uring->inflight) >= uring->cq_entries) {
+        current->no_preempt--;
+        return -1;
+    }
+    struct io_uring_sqe *sqe = &uring->sqes[tail & uring->sq_mask];
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = opcode;
+    sqe->fd = fd;
+    sqe->addr = (uintptr_t)buf;
+    // a larger one is cut short, like a short read()
+    sqe->len = count > UINT32_MAX ? UINT32_MAX : count;
+    // -1 means current file position
+    sqe->off = offset;
+    sqe->user_data = (uintptr_t)&op;
+    // the kernel sees it once the tail moves, and it is submitted by the scheduler, see flushUring()
+    atomic_store_explicit(uring->sq_tail, tail + 1, memory_order_release);
+    if (!uring->pending++) {
+        uring->pending_since = getTime();
+    }
+    atomic_fetch_add(&uring->inflight, 1);
+    // busy workers keep polling while it is pending, see completeUring()
+    atomic_fetch_add(&current->sched->io_waiters, 1);
+    atomic_store(&current->wait_state, TASK_PARKING);
+    parkCurrent(current);
+    current->no_preempt--;
+
+    if (op.res < 0) {
+        errno = -op.res;
+        *res = -1;
+    } else {
+        *res = op.res;
+    }
+    return 0;
+}
+
+// check if fd is a regular file or block device, with io_uring of sched in use
+static int isFile(m_sched_t *sched, int fd) {
+    if (!sched->use_uring) {
+        return 0;
+    }
+    FdState_t *state = getFdState(sched, fd);
+    if (!state) {
+        return 0;
+    }
+    int type = atomic_load_explicit(&state->type, memory_order_relaxed);
+    if (type == FD_UNKNOWN) {
+        struct stat st;
+        if (fstat(fd, &st)) {
+            return 0;
+        }
+        type = S_ISREG(st.st_mode) || S_ISBLK(st.st_mode) ? FD_FILE : FD_POLLABLE;
+        atomic_store_explicit(&state->type, type, memory_order_relaxed);
+    }
+    return type == FD_FILE;
+}
+
+// read or write a file at its current position through io_uring
+// return 0 with result in res, or -1 if fd shall be waited by epoll instead
+static int fileIO(uint8_t opcode, int fd, void *buf, size_t count, ssize_t *res) {
+    TaskStruct_t *current = currentThread();
+    if (!current || !isFile(current->sched, fd) || uringIO(opcode, fd, buf, count, -1, res)) {
+        return -1;
+    }
+    if (*res < 0 && errno == EAGAIN) {
+        // fd has been closed and reused for a non-blocking pipe or socket
+        atomic_store(&getFdState(current->sched, fd)->type, FD_POLLABLE);
+        return -1;
+    }
+    return 0;
+}
+
+ssize_t m_thread_read(int fd, void *buf, size_t count) {
+    ssize_t n;
+    if (!fileIO(IORING_OP_READ, fd, buf, count, &n)) {
+        return n;
+    }
+    if (setNonBlocking(fd)) {
+        return -1;
+    }
+    while (1) {
+        ssize_t n = read(fd, buf, count);
+        if (n >= 0 || (errno != EAGAIN && errno != EWOULDBLOCK)) {
+            return n;
+        }
+        if (waitFd(fd, POLLIN)) {
+            return -1;
+        }
+    }
+}
+
+ssize_t m_thread_write(int fd, const void *buf, size_t count) {
+    ssize_t n;
+    if (!fileIO(IORING_OP_WRITE, fd, (void *)buf, count, &n)) {
+        return n;
+    }
+    if (setNonBlocking(fd)) {
+        return -1;
+    }
+    while (1) {
+        ssize_t n = write(fd, buf, count);
+        if (n >= 0 || (errno != EAGAIN && errno != EWOULDBLOCK)) {
+            return n;
+        }
+        if (waitFd(fd, POLLOUT)) {
+            return -1;
+        }
+    }
+}
+
+int m_thread_accept(int fd, struct sockaddr *addr, socklen_t *addrlen) {
+    if (setNonBlocking(fd)) {
+        return -1;
+    }
+    while (1) {
+        int conn = accept4(fd, addr, addrlen, SOCK_NONBLOCK);
+        if (conn >= 0 || (errno != EAGAIN && errno != EWOULDBLOCK)) {
+            return conn;
+        }
+        if (waitFd(fd, POLLIN)) {
+            return -1;
+        }
+    }
+}
+
+int m_thread_connect(int fd, const struct sockaddr *addr, socklen_t addrlen) {
+    if (setNonBlocking(fd)) {
+        return -1;
+    }
+    if (!connect(fd, addr, addrlen)) {
+        return 0;
+    }
+    if (errno != EINPROGRESS) {
+        return -1;
+    }
+    // connection completes when it is writable
+    if (waitFd(fd, POLLOUT)) {
+        return -1;
+    }
+    int err;
+    socklen_t len = sizeof(err);
+    if (getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &len)) {
+        return -1;
+    }
+    if (err) {
+        errno = err;
+        return -1;
+    }
+    return 0;
+}
+
+// --- offload ---
+
+// body of an offload thread of sched: run jobs until the pool stops
+static void *runOffloadThread(void *arg) {
+    m_sched_t *sched = arg;
+    while (1) {
+        pthread_mutex_lock(&sched->offload_lock);
+        while (!sched->offload_head && !sched->offload_stop) {
+            pthread_cond_wait(&sched->offload_cond, &sched->offload_lock);
+        }
+        OffloadJob_t *job = sched->offload_head;
+        if (!job) {
+            pthread_mutex_unlock(&sched->offload_lock);
+            return NULL;
+        }
+        sched->offload_head = job->next;
+        if (!sched->offload_head) {
+            sched->offload_tail = NULL;
+        }
+        pthread_mutex_unlock(&sched->offload_lock);
+
+        job->result = job->fn(job->arg);
+        job->err = errno;
+
+        // hand it over to the scheduler, it must not be touched after that
+        OffloadJob_t *head = atomic_load(&sched->offload_done);
+        do {
+            job->next = head;
+        } while (!atomic_compare_exchange_weak(&sched->offload_done, &head, job));
+        uint64_t one = 1;
+        if (write(sched->offload_fd, &one, sizeof(one)) < 0) {
+            perror("write offload_fd failed in runOffloadThread");
+        }
+    }
+}
+
+// start offload pool of sched if it is not started, offload_lock shall be held
+static int startOffloadPool(m_sched_t *sched) {
+    if (sched->offload_thread_count) {
+        return 0;
+    }
+    sched->offload_threads = malloc(sched->offload_pool_size * sizeof(pthread_t));
+    if (!sched->offload_threads) {
+        return -1;
+    }
+    for (; sched->offload_thread_count < sched->offload_pool_size; sched->offload_thread_count++) {
+        if (pthread_create(&sched->offload_threads[sched->offload_thread_count], NULL, runOffloadThread, sched)) {
+            break;
+        }
+    }
+    if (!sched->offload_thread_count) {
+        free(sched->offload_threads);
+        sched->offload_threads = NULL;
+        return -1;
+    }
+    return 0;
+}
+
+// stop offload pool of sched, no job shall be pending
+static void stopOffloadPool(m_sched_t *sched) {
+    pthread_mutex_lock(&sched->offload_lock);
+    sched->offload_stop = 1;
+    pthread_cond_broadcast(&sched->offload_cond);
+    pthread_mutex_unlock(&sched->offload_lock);
+    for (unsigned int i = 0; i < sched->offload_thread_count; i++) {
+        pthread_join(sched->offload_threads[i], NULL);
+    }
+    free(sched->offload_threads);
+    sched->offload_threads = NULL;
+    sched->offload_thread_count = 0;
+    sched->offload_stop = 0;
+}
+
+void *m_thread_offload(void *(*fn)(void *), void *arg) {
+    TaskStruct_t *current = currentThread();
+    if (!current) {
+        // nothing else can run while it blocks anyway
+        return fn(arg);
+    }
+
+    testCancel(current);
+    OffloadJob_t job = {.fn = fn, .arg = arg, .task = current};
+    m_sched_t *sched = current->sched;
+    current->no_preempt++;
+    pthread_mutex_lock(&sched->offload_lock);
+    if (startOffloadPool(sched)) {
+        // no pool, block the worker rather than fail
+        pthread_mutex_unlock(&sched->offload_lock);
+        current->no_preempt--;
+        return fn(arg);
+    }
+    // busy workers keep polling while it is pending
+    atomic_fetch_add(&sched->io_waiters, 1);
+    atomic_store(&current->wait_state, TASK_PARKING);
+    if (sched->offload_tail) {
+        sched->offload_tail->next = &job;
+    } else {
+        sched->offload_head = &job;
+    }
+    sched->offload_tail = &job;
+    pthread_cond_signal(&sched->offload_cond);
+    pthread_mutex_unlock(&sched->offload_lock);
+
+    parkCurrent(current);
+    current->no_preempt--;
+    errno = job.err;
+    return job.result;
+}
+
+// --- file I/O ---
+
+ssize_t m_thread_pread(int fd, void *buf, size_t count, off_t offset) {
+    if (offset < 0) {
+        errno = EINVAL;
+        return -1;
+    }
+    ssize_t n;
+    if (!uringIO(IORING_OP_READ, fd, buf, count, offset, &n)) {
+        return n;
+    }
+    return pread(fd, buf, count, offset);
+}
+
+ssize_t m_thread_pwrite(int fd, const void *buf, size_t count, off_t offset) {
+    if (offset < 0) {
+        errno = EINVAL;
+        return -1;
+    }
+    ssize_t n;
+    if (!uringIO(IORING_OP_WRITE, fd, (void *)buf, count, offset, &n)) {
+        return n;
+    }
+    return pwrite(fd, buf, count, offset);
+}
+
+static void *callFsync(void *arg) {
+    return (void *)(intptr_t)fsync((int)(intptr_t)arg);
+}
+
+int m_thread_fsync(int fd) {
+    ssize_t n;
+    if (!uringIO(IORING_OP_FSYNC, fd, NULL, 0, 0, &n)) {
+        return (int)n;
+    }
+    return (int)(intptr_t)m_thread_offload(callFsync, (void *)(intptr_t)fd);
+}
+
+// --- synchronization ---
+
+// queue current task in q and park it, lock protects q and is released before parking
+// preemption must be disabled (no_preempt)
+static void waitQueue(TaskQueue_t *q, _Atomic int *lock, TaskStruct_t *current) {
+    atomic_store(&current->wait_state, TASK_PARKING);
+    enqueueTask(q, current);
+    spinUnlock(lock);
+    parkCurrent(current);
+}
+
+// the caller would wait, but it is not in a thread
+static int waitOutside(_Atomic int *lock) {
+    spinUnlock(lock);
+    errno = EBUSY;
+    return -1;
+}
+
+int m_mutex_init(m_mutex_t *mutex) {
+    *mutex = (m_mutex_t)M_MUTEX_INITIALIZER;
+    return 0;
+}
+
+int m_mutex_lock(m_mutex_t *mutex) {
+    TaskStruct_t *current = currentThread();
+    int ret = 0;
+    m_thread_preempt_disable();
+    spinLock(&mutex->lock);
+    if (!mutex->locked) {
+        mutex->locked = 1;
+        spinUnlock(&mutex->lock);
+    } else if (current) {
+        // m_mutex_unlock() hands it over, it stays locked
+        waitQueue(&mutex->waiters, &mutex->lock, current);
+    } else {
+        ret = waitOutside(&mutex->lock);
+    }
+    m_thread_preempt_enable();
+    return ret;
+}
+
+int m_mutex_trylock(m_mutex_t *mutex) {
+    int ret = 0;
+    m_thread_preempt_disable();
+    spinLock(&mutex->lock);
+    if (mutex->locked) {
+        errno = EBUSY;
+        ret = -1;
+    } else {
+        mutex->locked = 1;
+    }
+    spinUnlock(&mutex->lock);
+    m_thread_preempt_enable();
+    return ret;
+}
+
+int m_mutex_unlock(m_mutex_t *mutex) {
+    m_thread_preempt_disable();
+    spinLock(&mutex->lock);
+    TaskStruct_t *next = dequeueTask(&mutex->waiters);
+    if (!next) {
+        mutex->locked = 0;
+    }
+    spinUnlock(&mutex->lock);
+    if (next) {
+        wakeTask(next);
+    }
+    m_thread_preempt_enable();
+    return 0;
+}
+
+int m_cond_init(m_cond_t *cond) {
+    *cond = (m_cond_t)M_COND_INITIALIZER;
+    return 0;
+}
+
+int m_cond_wait(m_cond_t *cond, m_mutex_t *mutex) {
+    TaskStruct_t *current = currentThread();
+    if (!current) {
+        errno = EBUSY;
+        return -1;
+    }
+    m_thread_preempt_disable();
+    spinLock(&cond->lock);
+    // queued before mutex is unlocked, so a signal after that won't be lost: it cancels the parking
+    atomic_store(&current->wait_state, TASK_PARKING);
+    enqueueTask(&cond->waiters, current);
+    spinUnlock(&cond->lock);
+    m_mutex_unlock(mutex);
+    parkCurrent(current);
+    m_mutex_lock(mutex);
+    m_thread_preempt_enable();
+    return 0;
+}
+
+int m_cond_signal(m_cond_t *cond) {
+    m_thread_preempt_disable();
+    spinLock(&cond->lock);
+    TaskStruct_t *next = dequeueTask(&cond->waiters);
+    spinUnlock(&cond->lock);
+    if (next) {
+        wakeTask(next);
+    }
+    m_thread_preempt_enable();
+    return 0;
+}
+
+// wake up every task in q, q shall be taken over from the primitive first
+static void wakeAll(TaskQueue_t *q) {
+    TaskStruct_t *next;
+    while ((next = dequeueTask(q))) {
+        wakeTask(next);
+    }
+}
+
+int m_cond_broadcast(m_cond_t *cond) {
+    m_thread_preempt_disable();
+    spinLock(&cond->lock);
+    TaskQueue_t waiters = cond->waiters;
+    cond->waiters = (TaskQueue_t){0};
+    spinUnlock(&cond->lock);
+    wakeAll(&waiters);
+    m_thread_preempt_enable();
+    return 0;
+}
+
+int m_sem_init(m_sem_t *sem, unsigned int value) {
+    *sem = (m_sem_t)M_SEM_INITIALIZER(value);
+    return 0;
+}
+
+int m_sem_wait(m_sem_t *sem) {
+    TaskStruct_t *current = currentThread();
+    int ret = 0;
+    m_thread_preempt_disable();
+    spinLock(&sem->lock);
+    if (sem->value) {
+        sem->value--;
+        spinUnlock(&sem->lock);
+    } else if (current) {
+        // m_sem_post() hands its unit over
+        waitQueue(&sem->waiters, &sem->lock, current);
+    } else {
+        ret = waitOutside(&sem->lock);
+    }
+    m_thread_preempt_enable();
+    return ret;
+}
+
+int m_sem_trywait(m_sem_t *sem) {
+    int ret = 0;
+    m_thread_preempt_disable();
+    spinLock(&sem->lock);
+    if (sem->value) {
+        sem->value--;
+    } else {
+        errno = EAGAIN;
+        ret = -1;
+    }
+    spinUnlock(&sem->lock);
+    m_thread_preempt_enable();
+    return ret;
+}
+
+int m_sem_post(m_sem_t *sem) {
+    m_thread_preempt_disable();
+    spinLock(&sem->lock);
+    TaskStruct_t *next = dequeueTask(&sem->waiters);
+    if (!next) {
+        sem->value++;
+    }
+    spinUnlock(&sem->lock);
+    if (next) {
+        wakeTask(next);
+    }
+    m_thread_preempt_enable();
+    return 0;
+}
+
+int m_rwlock_init(m_rwlock_t *rwlock) {
+    *rwlock = (m_rwlock_t)M_RWLOCK_INITIALIZER;
+    return 0;
+}
+
+int m_rwlock_rdlock(m_rwlock_t *rwlock) {
+    TaskStruct_t *current = currentThread();
+    int ret = 0;
+    m_thread_preempt_disable();
+    spinLock(&rwlock->lock);
+    if (!rwlock->writer && !rwlock->write_waiters.size) {
+        rwlock->readers++;
+        spinUnlock(&rwlock->lock);
+    } else if (current) {
+        // m_rwlock_unlock() counts it in readers before waking it up
+        waitQueue(&rwlock->read_waiters, &rwlock->lock, current);
+    } else {
+        ret = waitOutside(&rwlock->lock);
+    }
+    m_thread_preempt_enable();
+    return ret;
+}
+
+int m_rwlock_wrlock(m_rwlock_t *rwlock) {
+    TaskStruct_t *current = currentThread();
+    int ret = 0;
+    m_thread_preempt_disable();
+    spinLock(&rwlock->lock);
+    if (!rwlock->writer && !rwlock->readers) {
+        rwlock->writer = 1;
+        spinUnlock(&rwlock->lock);
+    } else if (current) {
+        // m_rwlock_unlock() hands it over
+        waitQueue(&rwlock->write_waiters, &rwlock->lock, current);
+    } else {
+        ret = waitOutside(&rwlock->lock);
+    }
+    m_thread_preempt_enable();
+    return ret;
+}
+
+int m_rwlock_unlock(m_rwlock_t *rwlock) {
+    TaskQueue_t readers = {0};
+    TaskStruct_t *writer = NULL;
+    m_thread_preempt_disable();
+    spinLock(&rwlock->lock);
+    // the other side goes first
+    int by_writer = rwlock->writer;
+    if (by_writer) {
+        rwlock->writer = 0;
+    } else {
+        rwlock->readers--;
+    }
+    if (!rwlock->readers) {
+        if (rwlock->read_waiters.size && (by_writer || !rwlock->write_waiters.size)) {
+            // let all waiting readers in
+            readers = rwlock->read_waiters;
+            rwlock->read_waiters = (TaskQueue_t){0};
+            rwlock->readers = readers.size;
+        } else if ((writer = dequeueTask(&rwlock->write_waiters))) {
+            rwlock->writer = 1;
+        }
+    }
+    spinUnlock(&rwlock->lock);
+    wakeAll(&readers);
+    if (writer) {
+        wakeTask(writer);
+    }
+    m_thread_preempt_enable();
+    return 0;
+}
+
+// --- channel ---
+
+// ChanWaiter_t: a parked operation on a channel, lives on the stack of the waiting task
+// a task waits on several channels at the same time in m_chan_select(), the first one that claims its shared selected
+// completes it, the others just drop it
+typedef struct ChanWaiter_t {
+    TaskStruct_t *task;
+    struct ChanWaiter_t *prev;
+    struct ChanWaiter_t *next;
+    // element to send, or buffer to receive into
+    void *elem;
+    // it is in a waiter list of the channel
+    int queued;
+    // set if it is completed by m_chan_close()
+    int closed;
+    // index of the case in m_chan_select()
+    int index;
+    // index of the completed case, -1 if none yet. shared by all waiters of a select
+    _Atomic int *selected;
+} ChanWaiter_t;
+
+typedef struct ChanWaiterList_t {
+    ChanWaiter_t *head;
+    ChanWaiter_t *tail;
+} ChanWaiterList_t;
+
+struct m_chan_t {
+    // spin lock protecting the fields below
+    _Atomic int lock;
+    int closed;
+    size_t elem_size;
+    size_t capacity;
+    // ring buffer of elements
+    char *buffer;
+    size_t head;
+    size_t count;
+    // only when buffer is empty
+    ChanWaiterList_t receivers;
+    // only when buffer is full
+    ChanWaiterList_t senders;
+};
+
+static void pushWaiter(ChanWaiterList_t *list, ChanWaiter_t *w) {
+    w->next = NULL;
+    w->prev = list->tail;
+    if (list->tail) {
+        list->tail->next = w;
+    } else {
+        list->head = w;
+    }
+    list->tail = w;
+    w->queued = 1;
+}
+
+static void removeWaiter(ChanWaiterList_t *list, ChanWaiter_t *w) {
+    if (w->prev) {
+        w->prev->next = w->next;
+    } else {
+        list->head = w->next;
+    }
+    if (w->next) {
+        w->next->prev = w->prev;
+    } else {
+        list->tail = w->prev;
+    }
+    w->queued = 0;
+}
+
+// take the first waiter in list that is still waiting, and claim it: it is completed by the caller. waiters whose
+// select has been completed by other channels are dropped
+static ChanWaiter_t *claimWaiter(ChanWaiterList_t *list) {
+    ChanWaiter_t *w;
+    while ((w = list->head)) {
+        removeWaiter(list, w);
+        int expected = -1;
+        if (atomic_compare_exchange_strong(w->selected, &expected, w->index)) {
+            return w;
+        }
+    }
+    return NULL;
+}
+
+static void pushElem(m_chan_t *chan, const void *elem) {
+    size_t tail = (chan->head + chan->count) % chan->capacity;
+    memcpy(chan->buffer + tail * chan->elem_size, elem, chan->elem_size);
+    chan->count++;
+}
+
+static void popElem(m_chan_t *chan, void *elem) {
+    memcpy(elem, chan->buffer + chan->head * chan->elem_size, chan->elem_size);
+    chan->head = (chan->head + 1) % chan->capacity;
+    chan->count--;
+}
+
+// an operation on chan can complete without waiting. chan->lock shall be held
+static int chanReady(m_chan_t *chan, int op) {
+    // receivers wait only if buffer is empty, so a sender can always complete if buffer is not full
+    return chan->closed || (op == M_CHAN_SEND ? chan->count < chan->capacity : chan->count > 0);
+}
+
+// complete a ready operation on chan. the task of the waiter completed along with it is queued in wake, so the caller
+// wakes it up after releasing the lock. chan->lock shall be held
+static void chanComplete(m_chan_t *chan, int op, void *elem, int *closed, TaskQueue_t *wake) {
+    ChanWaiter_t *w;
+    if (op == M_CHAN_SEND) {
+        if (chan->closed) {
+            *closed = 1;
+        } else if ((w = claimWaiter(&chan->receivers))) {
+            // hand it over
+            memcpy(w->elem, elem, chan->elem_size);
+            enqueueTask(wake, w->task);
+        } else {
+            pushElem(chan, elem);
+        }
+    } else {
+        if (chan->count) {
+            popElem(chan, elem);
+            // a room is available now
+            if ((w = claimWaiter(&chan->senders))) {
+                pushElem(chan, w->elem);
+                enqueueTask(wake, w->task);
+            }
+        } else {
+            *closed = 1;
+        }
+    }
+}
+
+m_chan_t *m_chan_create(size_t elem_size, size_t capacity) {
+    if (!elem_size || !capacity || capacity > SIZE_MAX / elem_size) {
+        return NULL;
+    }
+    m_thread_preempt_disable();
+    m_chan_t *chan = calloc(1, sizeof(m_chan_t));
+    char *buffer = malloc(elem_size * capacity);
+    if (!chan || !buffer) {
+        free(chan);
+        free(buffer);
+        chan = NULL;
+    } else {
+        chan->elem_size = elem_size;
+        chan->capacity = capacity;
+        chan->buffer = buffer;
+    }
+    m_thread_preempt_enable();
+    return chan;
+}
+
+void m_chan_destroy(m_chan_t *chan) {
+    if (!chan) {
+        return;
+    }
+    m_thread_preempt_disable();
+    free(chan->buffer);
+    free(chan);
+    m_thread_preempt_enable();
+}
+
+int m_chan_close(m_chan_t *chan) {
+    TaskQueue_t wake = {0};
+    m_thread_preempt_disable();
+    spinLock(&chan->lock);
+    chan->closed = 1;
+    ChanWaiterList_t *lists[2] = {&chan->receivers, &chan->senders};
+    for (int i = 0; i < 2; i++) {
+        ChanWaiter_t *w;
+        while ((w = claimWaiter(lists[i]))) {
+            w->closed = 1;
+            enqueueTask(&wake, w->task);
+        }
+    }
+    spinUnlock(&chan->lock);
+    wakeAll(&wake);
+    m_thread_preempt_enable();
+    return 0;
+}
+
+int m_chan_select(m_chan_case_t *cases, size_t n) {
+    static _Atomic unsigned int round_robin;
+    if (!n) {
+        errno = EINVAL;
+        return -1;
+    }
+    TaskStruct_t *current = currentThread();
+    ChanWaiter_t waiters[n];
+    _Atomic int selected = -1;
+    TaskQueue_t wake = {0};
+    size_t start = atomic_fetch_add_explicit(&round_robin, 1, memory_order_relaxed) % n;
+    // number of cases visited, the waiters of them are queued, except the one completed by itself
+    size_t visited = 0;
+    int completed = 0;
+
+    m_thread_preempt_disable();
+    if (current) {
+        atomic_store(&current->wait_state, TASK_PARKING);
+    }
+    // complete the first ready one, or wait on every channel until a peer completes one of them
+    for (; visited < n; visited++) {
+        size_t i = (start + visited) % n;
+        m_chan_case_t *c = &cases[i];
+        c->closed = 0;
+        spinLock(&c->chan->lock);
+        if (chanReady(c->chan, c->op)) {
+            int expected = -1;
+            if (atomic_compare_exchange_strong(&selected, &expected, i)) {
+                chanComplete(c->chan, c->op, c->elem, &c->closed, &wake);
+                completed = 1;
+            }
+            // else a peer has completed one of its waiters already
+            spinUnlock(&c->chan->lock);
+            break;
+        }
+        if (current) {
+            waiters[i] = (ChanWaiter_t){.task = current, .elem = c->elem, .index = i, .selected = &selected};
+            pushWaiter(c->op == M_CHAN_SEND ? &c->chan->senders : &c->chan->receivers, &waiters[i]);
+        }
+        spinUnlock(&c->chan->lock);
+    }
+
+    if (current) {
+        if (completed) {
+            // no peer can claim it now, so nobody wakes it up
+            atomic_store(&current->wait_state, TASK_RUNNING);
+        } else {
+            // the peer that has claimed it (or will claim it) wakes it up
+            parkCurrent(current);
+        }
+        // drop the waiters left in other channels
+        for (size_t k = 0; k < visited; k++) {
+            size_t i = (start + k) % n;
+            m_chan_t *chan = cases[i].chan;
+            spinLock(&chan->lock);
+            if (waiters[i].queued) {
+                removeWaiter(cases[i].op == M_CHAN_SEND ? &chan->senders : &chan->receivers, &waiters[i]);
+            }
+            spinUnlock(&chan->lock);
+        }
+    }
+    wakeAll(&wake);
+    m_thread_preempt_enable();
+
+    int index = atomic_load(&selected);
+    if (index == -1) {
+        // outside a thread, and none is ready
+        errno = EBUSY;
+        return -1;
+    }
+    if (!completed) {
+        cases[index].closed = waiters[index].closed;
+    }
+    return index;
+}
+
+int m_chan_send(m_chan_t *chan, const void *elem) {
+    m_chan_case_t c = {.chan = chan, .op = M_CHAN_SEND, .elem = (void *)elem};
+    if (m_chan_select(&c, 1) < 0) {
+        return -1;
+    }
+    if (c.closed) {
+        errno = EPIPE;
+        return -1;
+    }
+    return 0;
+}
+
+int m_chan_recv(m_chan_t *chan, void *elem) {
+    m_chan_case_t c = {.chan = chan, .op = M_CHAN_RECV, .elem = elem};
+    if (m_chan_select(&c, 1) < 0) {
+        return -1;
+    }
+    if (c.closed) {
+        errno = EPIPE;
+        return -1;
+    }
+    return 0;
+}
+
+size_t m_chan_send_batch(m_chan_t *chan, const void *elems, size_t n) {
+    const char *elem = elems;
+    size_t sent = 0;
+    while (sent < n) {
+        // send as many as possible at once
+        TaskQueue_t wake = {0};
+        int closed = 0;
+        m_thread_preempt_disable();
+        spinLock(&chan->lock);
+        while (sent < n && !chan->closed && chanReady(chan, M_CHAN_SEND)) {
+            chanComplete(chan, M_CHAN_SEND, (void *)elem, &closed, &wake);
+            elem += chan->elem_size;
+            sent++;
+        }
+        closed = chan->closed;
+        spinUnlock(&chan->lock);
+        wakeAll(&wake);
+        m_thread_preempt_enable();
+        if (sent == n || closed) {
+            break;
+        }
+        // full, wait for a room
+        if (m_chan_send(chan, elem)) {
+            break;
+        }
+        elem += chan->elem_size;
+        sent++;
+    }
+    return sent;
+}
+
+size_t m_chan_recv_batch(m_chan_t *chan, void *elems, size_t n) {
+    char *elem = elems;
+    size_t received = 0;
+    while (received < n) {
+        // take as many as possible at once
+        TaskQueue_t wake = {0};
+        int closed = 0;
+        m_thread_preempt_disable();
+        spinLock(&chan->lock);
+        while (received < n && chan->count) {
+            chanComplete(chan, M_CHAN_RECV, elem, &closed, &wake);
+            elem += chan->elem_size;
+            received++;
+        }
+        closed = chan->closed;
+        spinUnlock(&chan->lock);
+        wakeAll(&wake);
+        m_thread_preempt_enable();
+        if (received || closed) {
+            break;
+        }
+        // empty, wait for the first one
+        if (m_chan_recv(chan, elem)) {
+            break;
+        }
+        elem += chan->elem_size;
+        received++;
+    }
+    return received;
+}
+
+int m_thread_set_sched(m_thread_t thread, const m_thread_sched_t *sched) {
+    if (!sched || !sched->weight) {
+        errno = EINVAL;
+        return -1;
+    }
+    int ret = 0;
+    m_thread_preempt_disable();
+    spinLock(&record_lock);
+    ThreadRecord_t **slot = findRecord(thread);
+    TaskStruct_t *task = slot ? (*slot)->task : NULL;
+    if (task) {
+        // it takes effect next time the task is pushed into a run queue
+        task->priority = sched->priority;
+        task->weight = sched->weight;
+        task->quantum = (uint64_t)sched->quantum_us * 1000;
+        if (task->quantum) {
+            task->sched->track_runtime = 1;
+        }
+    } else {
+        errno = ESRCH;
+        ret = -1;
+    }
+    spinUnlock(&record_lock);
+    m_thread_preempt_enable();
+    return ret;
+}
 
-typedef struct TaskStruct_t {
-    m_thread_t thread_id;
-    struct TaskStruct_t *next;
+int m_thread_get_sched(m_thread_t thread, m_thread_sched_t *sched) {
+    int ret = 0;
+    m_thread_preempt_disable();
+    spinLock(&record_lock);
+    ThreadRecord_t **slot = findRecord(thread);
+    TaskStruct_t *task = slot ? (*slot)->task : NULL;
+    if (task) {
+        sched->priority = task->priority;
+        sched->weight = task->weight;
+        sched->quantum_us = task->quantum / 1000;
+    } else {
+        errno = ESRCH;
+        ret = -1;
+    }
+    spinUnlock(&record_lock);
+    m_thread_preempt_enable();
+    return ret;
+}
 
-    int started;
-    char *stack;
-    ucontext_t *context;
-} TaskStruct_t;
+int m_thread_stats(m_thread_t thread, m_thread_stats_t *stats) {
+    int ret = 0;
+    m_thread_preempt_disable();
+    spinLock(&record_lock);
+    ThreadRecord_t **slot = findRecord(thread);
+    if (slot) {
+        // a running task updates its own statistics on the fly, they are only a snapshot
+        *stats = (*slot)->task ? (*slot)->task->stats : (*slot)->stats;
+    } else {
+        errno = ESRCH;
+        ret = -1;
+    }
+    spinUnlock(&record_lock);
+    m_thread_preempt_enable();
+    return ret;
+}
+
+int m_thread_set_stack(size_t size, size_t guard_size) {
+    if (size < MIN_STACK_SIZE) {
+        return -1;
+    }
+    stack_size = size;
+    stack_guard_size = guard_size;
+    // cached stacks no longer fit
+    releaseStackCache();
+    return 0;
+}
 
-// task_list
-struct TaskList_t {
-    TaskStruct_t sentinel;
-} task_list;
+m_sched_t *m_sched_self() {
+    TaskStruct_t *current = currentTask();
+    return current ? current->sched : &default_sched;
+}
 
-// pointer to the current task
-static volatile TaskStruct_t *current;
+// give a new task its id and record, and make it runnable on sched. the task is freed on failure
+// preemption must be disabled, record table is protected by a spin lock
+static int spawnTask(m_sched_t *sched, m_thread_t *ret, TaskStruct_t *task) {
+    task->sched = sched;
+    ThreadRecord_t *record = allocateRecord();
+    if (!record) {
+        freeTask(task);
+        return -1;
+    }
+    task->thread_id = atomic_fetch_add(&thread_count, 1);
 
-// used to indicate thread id
-static m_thread_t thread_count;
+    // a task of a group is waited by the group, nobody joins it
+    *record = (ThreadRecord_t){
+        .thread_id = task->thread_id, .detached = task->group != NULL, .task = task, .pool_index = record->pool_index};
 
-// schedule_context: context of schedule() function
-static ucontext_t schedule_context;
+    // inherit scheduling parameters
+    TaskStruct_t *current = currentTask();
+    if (current) {
+        task->priority = current->priority;
+        task->weight = current->weight;
+        task->quantum = current->quantum;
+        task->vruntime = current->vruntime;
+    }
+    spinLock(&record_lock);
+    int err = insertRecord(record);
+    spinUnlock(&record_lock);
+    if (err) {
+        freeTask(task);
+        freeRecord(record);
+        return -1;
+    }
+    task->record = record;
+    *ret = task->thread_id;
+    atomic_fetch_add(&sched->live_tasks, 1);
 
-// return_context: uc_link of user thread, which runs after user thread return, handles task delete
-static ucontext_t return_context;
+    // created by a user thread of the same scheduler: keep it on the same worker, others will steal it if they are
+    // idle
+    if (current && current->sched == sched) {
+        pushLocalTask(currentWorker(), task);
+    } else {
+        pushTask(task);
+    }
+    return 0;
+}
 
-// schedule context has started
-static int started;
+int m_thread_create(m_thread_t *ret, void (*func)(void *), void *arg) {
+    return m_sched_thread_create(m_sched_self(), ret, func, arg);
+}
 
-// global timer
-static timer_t timer;
+int m_sched_thread_create(m_sched_t *sched, m_thread_t *ret, void (*func)(void *), void *arg) {
+    if (!sched || !func || !ret) {
+        return -1;
+    }
 
-// push a task into task list
-static void pushTask(TaskStruct_t *task) {
+    // record table is protected by a spin lock, its holder shall not be preempted
+    m_thread_preempt_disable();
+    TaskStruct_t *task = allocateTask();
     if (!task) {
+        m_thread_preempt_enable();
+        return -1;
+    }
+    task->func = func;
+    task->arg = arg;
+    int err = spawnTask(sched, ret, task);
+    m_thread_preempt_enable();
+    return err;
+}
+
+// --- task group ---
+
+int m_task_group_init(m_task_group_t *group) {
+    *group = (m_task_group_t)M_TASK_GROUP_INITIALIZER;
+    return 0;
+}
+
+// a task of group has finished
+static void leaveGroup(m_task_group_t *group) {
+    spinLock(&group->lock);
+    if (--group->pending) {
+        spinUnlock(&group->lock);
         return;
     }
-    TaskStruct_t *curr = &task_list.sentinel;
-    while (curr->next) {
-        curr = curr->next;
+    // a waiter may return and free the group once the lock is released
+    TaskQueue_t waiters = group->waiters;
+    group->waiters = (TaskQueue_t){0};
+    spinUnlock(&group->lock);
+    wakeAll(&waiters);
+}
+
+int m_task_group_spawn(m_task_group_t *group, void (*func)(void *), void *arg) {
+    if (!group || !func) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    m_thread_preempt_disable();
+    TaskStruct_t *task = allocateTask();
+    if (!task) {
+        m_thread_preempt_enable();
+        return -1;
+    }
+    task->func = func;
+    task->arg = arg;
+    task->group = group;
+    spinLock(&group->lock);
+    group->pending++;
+    spinUnlock(&group->lock);
+    m_thread_t thread;
+    int err = spawnTask(m_sched_self(), &thread, task);
+    if (err) {
+        leaveGroup(group);
     }
-    curr->next = task;
+    m_thread_preempt_enable();
+    return err;
 }
 
-// get next task to execute of given current
-// return might be null
-// basically round-robin
-static TaskStruct_t *getNextTask(volatile TaskStruct_t *prev) {
-    if (!prev) {
-        return task_list.sentinel.next;
+int m_task_group_wait(m_task_group_t *group) {
+    TaskStruct_t *current = currentThread();
+    int ret = 0;
+    m_thread_preempt_disable();
+    spinLock(&group->lock);
+    if (!group->pending) {
+        spinUnlock(&group->lock);
+    } else if (current) {
+        // the last task of the group wakes it up
+        waitQueue(&group->waiters, &group->lock, current);
+    } else {
+        ret = waitOutside(&group->lock);
+    }
+    m_thread_preempt_enable();
+    return ret;
+}
+
+// a m_parallel_for() call, it lives on the stack of the caller, which waits for the helpers before returning
+typedef struct ParallelFor_t {
+    void (*fn)(size_t chunk_begin, size_t chunk_end, void *arg);
+    void *arg;
+    size_t end;
+    size_t grain;
+    // beginning of the next chunk
+    _Atomic size_t next;
+    m_task_group_t group;
+} ParallelFor_t;
+
+// take chunks of a m_parallel_for() call until none is left
+static void runParallelFor(void *arg) {
+    ParallelFor_t *pf = arg;
+    size_t begin = atomic_load(&pf->next);
+    while (begin < pf->end) {
+        size_t end = pf->end - begin > pf->grain ? begin + pf->grain : pf->end;
+        if (atomic_compare_exchange_weak(&pf->next, &begin, end)) {
+            pf->fn(begin, end, pf->arg);
+            begin = end;
+        }
+    }
+}
+
+int m_parallel_for(size_t begin, size_t end, size_t grain, void (*fn)(size_t chunk_begin, size_t chunk_end, void *arg),
+                   void *arg) {
+    if (!fn || !grain) {
+        errno = EINVAL;
+        return -1;
     }
-    if (prev->next) {
-        return prev->next;
+    ParallelFor_t pf = {.fn = fn, .arg = arg, .end = end, .grain = grain, .next = begin};
+    if (currentThread()) {
+        // chunks are taken dynamically, so a helper that gets no worker in time just finds nothing left
+        unsigned int n_workers = m_sched_self()->n_workers;
+        for (unsigned int i = 1; i < n_workers && begin < end && (end - begin - 1) / grain >= i; i++) {
+            if (m_task_group_spawn(&pf.group, runParallelFor, &pf)) {
+                break;
+            }
+        }
     }
-    return task_list.sentinel.next;
+    runParallelFor(&pf);
+    return m_task_group_wait(&pf.group);
 }
 
-// remove task from task_list, on success, return removed task, on failure, return NULL
-static TaskStruct_t *removeTask(volatile TaskStruct_t *task) {
+// --- coroutine ---
+
+int m_co_create(m_thread_t *ret, int (*step)(void *), void *arg) {
+    if (!step || !ret) {
+        return -1;
+    }
+    m_thread_preempt_disable();
+    TaskStruct_t *task = allocateCoroutine();
     if (!task) {
+        m_thread_preempt_enable();
+        return -1;
+    }
+    task->step = step;
+    task->arg = arg;
+    int err = spawnTask(m_sched_self(), ret, task);
+    m_thread_preempt_enable();
+    return err;
+}
+
+// current task if it is a coroutine, or NULL with errno EINVAL
+static TaskStruct_t *currentCoroutine() {
+    TaskStruct_t *current = currentTask();
+    if (!current || !current->step) {
+        errno = EINVAL;
         return NULL;
     }
+    return current;
+}
 
-    TaskStruct_t *prev = &task_list.sentinel, *curr = task_list.sentinel.next;
-    while (curr && curr != task) {
-        prev = curr;
-        curr = curr->next;
+int m_co_sleep(unsigned long long us) {
+    TaskStruct_t *current = currentCoroutine();
+    if (!current) {
+        return -1;
     }
-    if (curr) {
-        prev->next = curr->next;
-        curr->next = NULL;
-        return curr;
+    current->wake_time = getTime() + us * 1000;
+    atomic_store(&current->wait_state, TASK_PARKING);
+    int ret = pushSleeper(currentWorker(), current);
+    if (ret) {
+        atomic_store(&current->wait_state, TASK_RUNNING);
+        errno = ret < 0 ? ENOMEM : ECANCELED;
+        return -1;
     }
-
-    fprintf(stderr, "[Bug: task not in task_list]\n");
-    return NULL;
+    return 0;
 }
 
-// free memory owned by task
-static void freeTask(TaskStruct_t *task) {
-    free(task->stack);
-    free(task->context);
-    free(task);
+int m_co_wait_read(int fd) {
+    TaskStruct_t *current = currentCoroutine();
+    return current ? queueFdWaiter(current, fd, POLLIN) : -1;
 }
 
-// allocate memory for a task
-static TaskStruct_t *allocateTask() {
-    TaskStruct_t *task = malloc(sizeof(TaskStruct_t));
-    if (!task) {
-        return NULL;
-    }
+int m_co_wait_write(int fd) {
+    TaskStruct_t *current = currentCoroutine();
+    return current ? queueFdWaiter(current, fd, POLLOUT) : -1;
+}
 
-    task->thread_id = -1;
-    task->started = 0;
-    task->next = NULL;
-    task->context = malloc(sizeof(ucontext_t));
-    task->stack = malloc(SIGSTKSZ);
+// --- cancellation ---
 
-    if (!task->context || !task->stack) {
-        freeTask(task);
-        return NULL;
+int m_thread_cancel(m_thread_t thread) {
+    int ret = 0;
+    m_thread_preempt_disable();
+    spinLock(&record_lock);
+    ThreadRecord_t **slot = findRecord(thread);
+    if (!slot) {
+        errno = ESRCH;
+        ret = -1;
+    } else if ((*slot)->task) {
+        cancelTask((*slot)->task);
     }
+    spinUnlock(&record_lock);
+    m_thread_preempt_enable();
+    return ret;
+}
 
-    return task;
+void m_thread_testcancel() {
+    TaskStruct_t *current = currentThread();
+    if (current) {
+        testCancel(current);
+    }
 }
 
-static void schedule() {
-    while (1) {
-        // current is not null: from timer interrupt
-        if (current) {
-            current = getNextTask(current);
-            if (current) {
-                // printf("[Enter thread %lu]\n", current->thread_id);
-                swapcontext(&schedule_context, current->context);
-                // back from thread context
-            } else {
-                fprintf(stderr, "[Bug: no next task]\n");
-                return;
-            }
-        // current is null: from return_context or initial
-        } else {
-            current = getNextTask(current);
-            if (current) {
-                // printf("[Enter thread %lu]\n", current->thread_id);
-                swapcontext(&schedule_context, current->context);
-                // back from thread context
-            } else {
-                printf("[All tasks finish]\n");
-                return;
-            }
-        }
+int m_thread_setcanceltype(int type, int *oldtype) {
+    TaskStruct_t *current = currentThread();
+    if (!current) {
+        errno = EPERM;
+        return -1;
     }
+    if (type != M_THREAD_CANCEL_DEFERRED && type != M_THREAD_CANCEL_ASYNCHRONOUS) {
+        errno = EINVAL;
+        return -1;
+    }
+    if (oldtype) {
+        *oldtype = current->cancel_type;
+    }
+    current->cancel_type = type;
+    return 0;
 }
 
-// handle thread return, this context blocks timer interrupt
-static void handleReturn() {
-    if (current) {
-        if (current->started) {
-            fprintf(stderr, "[Bug: current %lld is running]\n", current->thread_id);
+int m_thread_set_deadline(m_thread_t thread, unsigned long long timeout_us) {
+    uint64_t deadline = timeout_us ? getTime() + timeout_us * 1000 : 0;
+    int ret = 0;
+    m_thread_preempt_disable();
+    spinLock(&record_lock);
+    ThreadRecord_t **slot = findRecord(thread);
+    TaskStruct_t *task = slot ? (*slot)->task : NULL;
+    if (task) {
+        m_sched_t *sched = task->sched;
+        TaskHeap_t *heap = &sched->deadline_heap;
+        spinLock(&sched->deadline_lock);
+        if (task->deadline) {
+            heapTake(heap, task);
         }
-        if (removeTask(current)) {
-            freeTask((TaskStruct_t *)current);
-            current = NULL;
-        } else {
-            fprintf(stderr, "[Bug: current %lld not in task_list]\n", current->thread_id);
-            current = NULL;
+        task->deadline = deadline;
+        if (deadline && heapPush(heap, deadline, task)) {
+            task->deadline = 0;
+            errno = ENOMEM;
+            ret = -1;
         }
+        atomic_store(&sched->next_deadline, heap->size ? heap->entries[0].key : NO_DEADLINE);
+        spinUnlock(&sched->deadline_lock);
     } else {
-        fprintf(stderr, "[Bug: null current in handleReturn]\n");
+        errno = ESRCH;
+        ret = -1;
     }
-
-    setcontext(&schedule_context);
+    spinUnlock(&record_lock);
+    m_thread_preempt_enable();
+    return ret;
 }
 
-static void timerInterrupt(int sig) {
-    if (current) {
+// --- thread local storage ---
 
-        // printf("[Timer interrupt %lu]\n", current->thread_id);
+int m_thread_key_create(m_thread_key_t *key, void (*destructor)(void *)) {
+    m_thread_preempt_disable();
+    spinLock(&key_lock);
+    m_thread_key_t k = 0;
+    while (k < M_THREAD_KEYS_MAX && key_used[k]) {
+        k++;
+    }
+    if (k == M_THREAD_KEYS_MAX) {
+        spinUnlock(&key_lock);
+        m_thread_preempt_enable();
+        errno = EAGAIN;
+        return -1;
+    }
+    key_used[k] = 1;
+    key_destructors[k] = destructor;
+    spinUnlock(&key_lock);
 
-        if (!current->started) {
-            return;
+    // a deleted key may have left values behind, new tasks start with NULL anyway
+    spinLock(&record_lock);
+    for (size_t i = 0; i < record_table_size; i++) {
+        for (ThreadRecord_t *r = record_table[i]; r; r = r->next) {
+            if (r->task) {
+                r->task->specific[k] = NULL;
+            }
         }
+    }
+    spinUnlock(&record_lock);
+    m_thread_preempt_enable();
+    *key = k;
+    return 0;
+}
 
-        // switch to scheduler context
-        swapcontext(current->context, &schedule_context);
-        // back from scheduler context, continue execution
+int m_thread_key_delete(m_thread_key_t key) {
+    int ret = 0;
+    m_thread_preempt_disable();
+    spinLock(&key_lock);
+    if (key < M_THREAD_KEYS_MAX && key_used[key]) {
+        key_used[key] = 0;
+        key_destructors[key] = NULL;
     } else {
-        fprintf(stderr, "[Bug: No current in timer interrupt]\n");
+        errno = EINVAL;
+        ret = -1;
     }
+    spinUnlock(&key_lock);
+    m_thread_preempt_enable();
+    return ret;
 }
 
-// to deal with async signal safe problems
-static void userThreadStart(void (*func)(void *), void *arg) {
-    if (current) {
-        current->started = 1;
-        func(arg);
-        current->started = 0;
-    } else {
-        fprintf(stderr, "[Bug: no current in userThreadStart]\n");
+void *m_thread_getspecific(m_thread_key_t key) {
+    TaskStruct_t *current = currentTask();
+    // the task can't move to another worker in between, it is the same task anyway
+    return current && key < M_THREAD_KEYS_MAX ? current->specific[key] : NULL;
+}
+
+int m_thread_setspecific(m_thread_key_t key, const void *value) {
+    if (key >= M_THREAD_KEYS_MAX) {
+        errno = EINVAL;
+        return -1;
+    }
+    TaskStruct_t *current = currentTask();
+    if (!current) {
+        errno = EPERM;
+        return -1;
     }
+    current->specific[key] = (void *)value;
+    return 0;
 }
 
-static void installTimer() {
-    struct sigevent sev = {.sigev_signo = INTERRUPT_SIGNAL, .sigev_notify = SIGEV_SIGNAL};
-    if (timer_create(CLOCK_REALTIME, &sev, &timer)) {
-        perror("timer create failed in installTimer");
+// call destructors of the values left in an exiting task, which may set values again, so try a few rounds like
+// pthread does
+static void destroySpecific(TaskStruct_t *task) {
+    for (int round = 0; round < PTHREAD_DESTRUCTOR_ITERATIONS; round++) {
+        int called = 0;
+        for (m_thread_key_t k = 0; k < M_THREAD_KEYS_MAX; k++) {
+            void *value = task->specific[k];
+            void (*destructor)(void *) = key_destructors[k];
+            if (!value || !destructor) {
+                continue;
+            }
+            task->specific[k] = NULL;
+            destructor(value);
+            called = 1;
+        }
+        if (!called) {
+            return;
+        }
     }
-    struct itimerspec spec = {.it_interval.tv_nsec = INTERRUPT_INTERVAL, .it_value.tv_nsec = INTERRUPT_INTERVAL};
-    if (timer_settime(timer, 0, &spec, NULL)) {
-        perror("timer settime failed in installTimer");
+}
+
+// --- log ---
+
+// write the whole buffer to fd, give up on error
+static void writeAll(int fd, const char *buf, size_t len) {
+    while (len) {
+        ssize_t n = write(fd, buf, len);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return;
+        }
+        buf += n;
+        len -= n;
     }
 }
 
-static void uninstallTimer() {
-    struct itimerspec spec = {0};
-    if (timer_settime(timer, 0, &spec, NULL)) {
-        perror("timer settime failed in uninstallTimer");
+// write log of worker to stdout, the caller shall not be preempted
+static void flushLog(Worker_t *worker) {
+    int saved_errno = errno;
+    writeAll(STDOUT_FILENO, worker->log, worker->log_len);
+    worker->log_len = 0;
+    errno = saved_errno;
+}
+
+int m_thread_log(const char *format, ...) {
+    char line[LOG_LINE_SIZE];
+    va_list args;
+    // the task can't move to another worker, and nothing else on this worker touches its buffer in between
+    m_thread_preempt_disable();
+    va_start(args, format);
+    int n = vsnprintf(line, sizeof(line), format, args);
+    va_end(args);
+    if (n < 0) {
+        m_thread_preempt_enable();
+        return -1;
+    }
+    // a longer message is cut
+    size_t len = (size_t)n < sizeof(line) ? (size_t)n : sizeof(line) - 1;
+    Worker_t *worker = currentWorker();
+    if (!worker) {
+        writeAll(STDOUT_FILENO, line, len);
+    } else {
+        if (worker->log_len + len > LOG_BUFFER_SIZE) {
+            flushLog(worker);
+        }
+        memcpy(worker->log + worker->log_len, line, len);
+        worker->log_len += len;
     }
+    m_thread_preempt_enable();
+    return n;
 }
 
-static void installInterruptHandler() {
-    struct sigaction action = {0};
-    action.sa_handler = timerInterrupt;
-    action.sa_flags = SA_RESTART;
-    sigaction(INTERRUPT_SIGNAL, &action, NULL);
+void m_thread_log_flush() {
+    m_thread_preempt_disable();
+    Worker_t *worker = currentWorker();
+    if (worker && worker->log_len) {
+        flushLog(worker);
+    }
+    m_thread_preempt_enable();
 }
 
-static void uninstallInterruptHandler() {
-    struct sigaction action = {0};
-    action.sa_handler = SIG_DFL;
-    sigaction(INTERRUPT_SIGNAL, &action, NULL);
+// body of a worker: run tasks until every task finishes
+static void *runWorker(void *arg) {
+    Worker_t *worker = arg;
+    local_worker = worker;
+    // worker 0 is the calling system thread, m_thread_cancel() signals it as well
+    worker->thread = pthread_self();
+
+    pthread_sigmask(SIG_BLOCK, NULL, &worker->idle_mask);
+    sigaddset(&worker->idle_mask, INTERRUPT_SIGNAL);
+
+    installTimer(worker);
+    schedule(worker);
+    flushLog(worker);
+
+    uninstallTimer(worker);
+    free(worker->sleepers.entries);
+    free(worker->run_heap.entries);
+    local_worker = NULL;
+    return NULL;
 }
 
-void blockInterrupt() {
-    sigset_t set;
-    sigprocmask(SIG_SETMASK, NULL, &set);
-    sigaddset(&set, INTERRUPT_SIGNAL);
-    sigprocmask(SIG_SETMASK, &set, NULL);
+// close I/O reactor of sched and free its fd table
+static void stopReactor(m_sched_t *sched) {
+    if (sched->epoll_fd >= 0) {
+        close(sched->epoll_fd);
+        sched->epoll_fd = -1;
+    }
+    if (sched->wake_fd >= 0) {
+        close(sched->wake_fd);
+        sched->wake_fd = -1;
+    }
+    if (sched->offload_fd >= 0) {
+        close(sched->offload_fd);
+        sched->offload_fd = -1;
+    }
+    sched->wake_pending = 0;
+    for (int i = 0; i < FD_TABLE_SIZE; i++) {
+        free(atomic_exchange(&sched->fd_table[i], NULL));
+    }
 }
 
-void unblockInterrupt() {
-    sigset_t set;
-    sigprocmask(SIG_SETMASK, NULL, &set);
-    sigdelset(&set, INTERRUPT_SIGNAL);
-    sigprocmask(SIG_SETMASK, &set, NULL);
+// map a ring of io_uring, return NULL if it fails
+static void *mapUring(int fd, size_t size, off_t offset) {
+    void *ring = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, offset);
+    return ring == MAP_FAILED ? NULL : ring;
 }
 
-m_thread_t m_thread_self() {
-    blockInterrupt();
-    if (current) {
-        m_thread_t id = current->thread_id;
-        unblockInterrupt();
-        return id;
+// close io_uring of a worker
+static void releaseUring(Uring_t *uring) {
+    if (uring->sqes) {
+        munmap(uring->sqes, uring->sqes_size);
     }
-    unblockInterrupt();
-    return -1;
+    if (uring->cq_ring) {
+        munmap(uring->cq_ring, uring->cq_ring_size);
+    }
+    if (uring->sq_ring) {
+        munmap(uring->sq_ring, uring->sq_ring_size);
+    }
+    if (uring->fd >= 0) {
+        close(uring->fd);
+    }
+    memset(uring, 0, sizeof(*uring));
+    uring->fd = -1;
 }
 
-int m_thread_yield() {
-    blockInterrupt();
-    if (current) {
-        // printf("[Thread %lld]yield\n", current->thread_id);
-        // go back to scheduler
-        swapcontext(current->context, &schedule_context);
-        // return from scheduler
-        unblockInterrupt();
-        return 0;
+// set up io_uring of a worker, its completions signal event_fd
+static int setupUring(Uring_t *uring, int event_fd) {
+    struct io_uring_params params = {0};
+    uring->fd = syscall(__NR_io_uring_setup, URING_ENTRIES, &params);
+    // reads and writes at current file position need it (5.6)
+    if (uring->fd < 0 || !(params.features & IORING_FEAT_RW_CUR_POS)) {
+        return -1;
+    }
+    uring->sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    uring->cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    uring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+    uring->sq_ring = mapUring(uring->fd, uring->sq_ring_size, IORING_OFF_SQ_RING);
+    uring->cq_ring = mapUring(uring->fd, uring->cq_ring_size, IORING_OFF_CQ_RING);
+    uring->sqes = mapUring(uring->fd, uring->sqes_size, IORING_OFF_SQES);
+    if (!uring->sq_ring || !uring->cq_ring || !uring->sqes) {
+        return -1;
     }
 
-    // not in a thread
-    unblockInterrupt();
-    return -1;
+    char *sq = uring->sq_ring;
+    uring->sq_head = (_Atomic unsigned *)(sq + params.sq_off.head);
+    uring->sq_tail = (_Atomic unsigned *)(sq + params.sq_off.tail);
+    uring->sq_mask = *(unsigned *)(sq + params.sq_off.ring_mask);
+    uring->sq_entries = params.sq_entries;
+    // sqes[i] always takes slot i
+    unsigned *array = (unsigned *)(sq + params.sq_off.array);
+    for (unsigned i = 0; i < params.sq_entries; i++) {
+        array[i] = i;
+    }
+    char *cq = uring->cq_ring;
+    uring->cq_head = (_Atomic unsigned *)(cq + params.cq_off.head);
+    uring->cq_tail = (_Atomic unsigned *)(cq + params.cq_off.tail);
+    uring->cq_mask = *(unsigned *)(cq + params.cq_off.ring_mask);
+    uring->cq_entries = params.cq_entries;
+    uring->cqes = (struct io_uring_cqe *)(cq + params.cq_off.cqes);
+
+    return syscall(__NR_io_uring_register, uring->fd, IORING_REGISTER_EVENTFD, &event_fd, 1) ? -1 : 0;
 }
 
-void m_thread_sleep(unsigned long long sec) {
-    m_thread_usleep(sec * 1000000);
+// close io_uring of every worker of sched
+static void releaseUrings(m_sched_t *sched) {
+    for (unsigned int i = 0; i < sched->n_workers; i++) {
+        releaseUring(&sched->workers[i].uring);
+    }
+    if (sched->uring_fd >= 0) {
+        close(sched->uring_fd);
+        sched->uring_fd = -1;
+    }
+    sched->use_uring = 0;
 }
 
-void m_thread_usleep(unsigned long long us) {
-    struct timespec start, now;
-    clock_gettime(CLOCK_REALTIME, &start);
-    while (1) {
-        clock_gettime(CLOCK_REALTIME, &now);
-        const unsigned long long elapsed = (now.tv_sec - start.tv_sec) * 1000000 + (now.tv_nsec - start.tv_nsec) / 1000;
-        if (elapsed < us) {
-            m_thread_yield();
-        } else {
-            break;
+// set up io_uring of every worker of sched, use_uring is set only if all of them are set up, or file I/O goes without
+// it
+static void setupUrings(m_sched_t *sched) {
+    sched->uring_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    struct epoll_event event = {.events = EPOLLIN, .data.fd = sched->uring_fd};
+    if (sched->uring_fd < 0 || epoll_ctl(sched->epoll_fd, EPOLL_CTL_ADD, sched->uring_fd, &event)) {
+        releaseUrings(sched);
+        return;
+    }
+    for (unsigned int i = 0; i < sched->n_workers; i++) {
+        if (setupUring(&sched->workers[i].uring, sched->uring_fd)) {
+            releaseUrings(sched);
+            return;
         }
     }
+    sched->use_uring = 1;
 }
 
-int m_thread_create(m_thread_t *ret, void (*func)(void *), void *arg) {
-    if (!func || !ret) {
-        return -1;
+// free the trace rings of sched
+static void releaseTrace(m_sched_t *sched) {
+    for (unsigned int i = 0; i < sched->trace_ring_count; i++) {
+        free(sched->trace_rings[i].events);
     }
+    free(sched->trace_rings);
+    sched->trace_rings = NULL;
+    sched->trace_ring_count = 0;
+    sched->trace_size = 0;
+}
 
-    TaskStruct_t *task;
-
-    if (started) {
-        // malloc is not async signal safe!!!
-        async_signal_safe(
-            task = allocateTask();
-            if (!task) {
-                unblockInterrupt();
-                return -1;
-            };
-        );
-    } else {
-        task = allocateTask();
-        if (!task) {
+// allocate a trace ring of size events for each of n workers of sched
+static int setupTrace(m_sched_t *sched, unsigned int n, size_t size) {
+    sched->trace_rings = calloc(n, sizeof(TraceRing_t));
+    if (!sched->trace_rings) {
+        return -1;
+    }
+    sched->trace_ring_count = n;
+    for (unsigned int i = 0; i < n; i++) {
+        sched->trace_rings[i].events = malloc(size * sizeof(TraceEvent_t));
+        if (!sched->trace_rings[i].events) {
+            releaseTrace(sched);
             return -1;
         }
     }
+    sched->trace_size = size;
+    sched->trace_start = getTime();
+    return 0;
+}
 
-    if (getcontext(task->context)) {
-        freeTask(task);
+int m_thread_trace_export(FILE *out) {
+    return m_sched_trace_export(&default_sched, out);
+}
+
+int m_sched_trace_export(m_sched_t *sched, FILE *out) {
+    if (!sched || !sched->trace_rings || sched->started) {
+        errno = ENOENT;
         return -1;
     }
-
-    task->context->uc_stack.ss_sp = task->stack;
-    task->context->uc_stack.ss_size = SIGSTKSZ;
-    task->context->uc_link = &return_context;
-
-    // user thread: do not block timer interrupt
-    sigdelset(&task->context->uc_sigmask, INTERRUPT_SIGNAL);
-
-    typedef void (*func_ptr) (void);
-    makecontext(task->context, (func_ptr)userThreadStart, 2, func, arg);
-
-    if (started) {
-        async_signal_safe(
-            task->thread_id = thread_count++;
-            pushTask(task);
-        );
-    } else {
-        task->thread_id = thread_count++;
-        pushTask(task);
+    TraceRing_t *trace_rings = sched->trace_rings;
+    size_t trace_size = sched->trace_size;
+    static const char *const reasons[] = {
+        [SLICE_PREEMPTED] = "preempted",
+        [SLICE_YIELDED] = "yielded",
+        [SLICE_PARKED] = "parked",
+        [SLICE_EXITED] = "exited",
+    };
+    fprintf(out, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[\n");
+    for (unsigned int i = 0; i < sched->trace_ring_count; i++) {
+        fprintf(out, "%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":0,\"tid\":%u,\"args\":{\"name\":\"worker %u\"}}",
+                i ? ",\n" : "", i, i);
     }
+    for (unsigned int i = 0; i < sched->trace_ring_count; i++) {
+        TraceRing_t *ring = &trace_rings[i];
+        // the oldest ones have been overwritten
+        size_t first = ring->count > trace_size ? ring->count - trace_size : 0;
+        for (size_t j = first; j < ring->count; j++) {
+            TraceEvent_t *event = &ring->events[j % trace_size];
+            // timestamps are in microseconds
+            fprintf(out, ",\n{\"name\":\"thread %lld\",\"ph\":\"X\",\"pid\":0,\"tid\":%u,\"ts\":%.3f,\"dur\":%.3f,"
+                         "\"args\":{\"thread\":%lld,\"end\":\"%s\"}}",
+                    (long long)event->thread_id, i, (event->start - sched->trace_start) / 1000.0,
+                    (event->end - event->start) / 1000.0, (long long)event->thread_id, reasons[event->reason]);
+        }
+    }
+    fprintf(out, "\n]}\n");
+    return ferror(out) ? -1 : 0;
+}
 
-    *ret = task->thread_id;
+m_sched_t *m_sched_create() {
+    m_sched_t *sched = malloc(sizeof(m_sched_t));
+    if (!sched) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    *sched = (m_sched_t)SCHED_INITIALIZER;
+    return sched;
+}
 
+int m_sched_destroy(m_sched_t *sched) {
+    if (!sched || sched == &default_sched) {
+        errno = EINVAL;
+        return -1;
+    }
+    if (atomic_load(&sched->started) || atomic_load(&sched->live_tasks)) {
+        errno = EBUSY;
+        return -1;
+    }
+    releaseTrace(sched);
+    pthread_mutex_destroy(&sched->task_list_lock);
+    pthread_mutex_destroy(&sched->offload_lock);
+    pthread_cond_destroy(&sched->offload_cond);
+    free(sched);
     return 0;
 }
 
 int m_thread_start() {
-    if (started) {
+    m_thread_config_t config = {.workers = 1};
+    return m_sched_start(&default_sched, &config);
+}
+
+int m_thread_start_config(const m_thread_config_t *config) {
+    return m_sched_start(&default_sched, config);
+}
+
+int m_sched_start(m_sched_t *sched, const m_thread_config_t *config) {
+    if (!sched || !config) {
+        return -1;
+    }
+    const SchedPolicy_t *policy;
+    switch (config->policy) {
+        case M_SCHED_RR:
+            policy = &rr_policy;
+            break;
+        case M_SCHED_PRIORITY:
+            policy = &priority_policy;
+            break;
+        case M_SCHED_FAIR:
+            policy = &fair_policy;
+            break;
+        default:
+            return -1;
+    }
+    // another system thread may be starting it at the same time
+    if (atomic_exchange(&sched->started, 1)) {
+        errno = EBUSY;
+        return -1;
+    }
+    sched->policy = policy;
+    sched->sched_quantum = config->quantum_us ? (uint64_t)config->quantum_us * 1000 : DEFAULT_QUANTUM;
+    sched->offload_pool_size = config->offload_threads ? config->offload_threads : DEFAULT_OFFLOAD_THREADS;
+    if (policy->account) {
+        sched->track_runtime = 1;
+    }
+
+    unsigned int n = config->workers;
+    if (!n) {
+        long cores = sysconf(_SC_NPROCESSORS_ONLN);
+        n = cores > 0 ? cores : 1;
+    }
+    Worker_t *workers = calloc(n, sizeof(Worker_t));
+    if (!workers) {
+        sched->started = 0;
         return -1;
     }
 
-    // scheduler needs block interrupt
-    blockInterrupt();
+    // the trace of the last run is dropped
+    releaseTrace(sched);
+    if (config->trace_size && setupTrace(sched, n, config->trace_size)) {
+        free(workers);
+        sched->started = 0;
+        return -1;
+    }
+    sched->collect_stats = config->stats || sched->trace_rings;
+    if (sched->collect_stats) {
+        sched->track_runtime = 1;
+    }
+    for (unsigned int i = 0; i < n; i++) {
+        workers[i].index = i;
+        workers[i].sched = sched;
+        workers[i].uring.fd = -1;
+    }
+    sched->workers = workers;
+    sched->n_workers = n;
 
-    // setup function return context
-    if (getcontext(&return_context)) {
-        unblockInterrupt();
+    // setup I/O reactor
+    sched->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    sched->wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    sched->offload_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    struct epoll_event event = {.events = EPOLLIN, .data.fd = sched->wake_fd};
+    struct epoll_event offload_event = {.events = EPOLLIN, .data.fd = sched->offload_fd};
+    if (sched->epoll_fd < 0 || sched->wake_fd < 0 || sched->offload_fd < 0 ||
+        epoll_ctl(sched->epoll_fd, EPOLL_CTL_ADD, sched->wake_fd, &event) ||
+        epoll_ctl(sched->epoll_fd, EPOLL_CTL_ADD, sched->offload_fd, &offload_event)) {
+        perror("setup I/O reactor failed in m_sched_start");
+        stopReactor(sched);
+        free(workers);
+        sched->workers = NULL;
+        sched->n_workers = 0;
+        sched->started = 0;
         return -1;
     }
-    char stack[SIGSTKSZ];
-    return_context.uc_stack.ss_sp = stack;
-    return_context.uc_stack.ss_size = SIGSTKSZ;
-    makecontext(&return_context, handleReturn, 0);
+    if (config->io_uring) {
+        setupUrings(sched);
+    }
 
+    // m_thread_log() bypasses stdio, let what was printed before come first
+    fflush(stdout);
+
+    // no_preempt protects scheduler and context switches, timer interrupt is never blocked. workers inherit it
+    unblockInterrupt();
     installInterruptHandler();
-    installTimer();
 
-    // enter schedule context
-    if (getcontext(&schedule_context)) {
-        uninstallTimer();
-        uninstallInterruptHandler();
-        unblockInterrupt();
-        return -1;
+    // the calling system thread is worker 0
+    unsigned int spawned = 1;
+    for (; spawned < n; spawned++) {
+        if (pthread_create(&workers[spawned].thread, NULL, runWorker, &workers[spawned])) {
+            perror("pthread create failed in m_sched_start");
+            break;
+        }
+    }
+    runWorker(&workers[0]);
+    for (unsigned int i = 1; i < spawned; i++) {
+        pthread_join(workers[i].thread, NULL);
     }
-    started = 1;
-    schedule();
-    started = 0;
+    printf("[All tasks finish]\n");
 
     // exit clean up
-    uninstallTimer();
+    stopOffloadPool(sched);
+    releaseUrings(sched);
+    stopReactor(sched);
+    free(sched->deadline_heap.entries);
+    sched->deadline_heap = (TaskHeap_t){0};
+    sched->workers = NULL;
+    sched->n_workers = 0;
+    free(workers);
     uninstallInterruptHandler();
-    unblockInterrupt();
+    releaseStackCache();
+    atomic_store(&sched->started, 0);
 
     return 0;
-}
\ No newline at end of file
+}
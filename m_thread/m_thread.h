@@ -2,41 +2,465 @@
 #define m_thread_h
 
 #include <stdint.h>
+#include <stdio.h>
+#include <sys/types.h>
+#include <sys/socket.h>
 
 typedef int64_t m_thread_t;
 
 // create && add a new thread, its thread id stored in ret
-// the thread won't start automatically
+// the thread won't start automatically. a thread created by a thread runs on the same scheduler, otherwise it runs on
+// the default one, see m_sched_t
 // ret and func shall not be NULL
 int m_thread_create(m_thread_t *ret, void (*func)(void *), void *arg);
 
+// scheduling parameters of a thread
+typedef struct m_thread_sched_t {
+    // M_SCHED_PRIORITY: higher runs first, default 0
+    int priority;
+    // M_SCHED_FAIR: share of cpu time, default 1024
+    unsigned int weight;
+    // time slice in microseconds, 0 (default) means the scheduler's quantum
+    unsigned int quantum_us;
+} m_thread_sched_t;
+
+// set scheduling parameters of a thread, which take effect next time it is queued. threads created by a thread
+// inherit its parameters, others get the defaults
+// return -1 with errno ESRCH if no such running thread, EINVAL if weight is 0
+int m_thread_set_sched(m_thread_t thread, const m_thread_sched_t *sched);
+
+// get scheduling parameters of a thread
+// return -1 with errno ESRCH if no such running thread
+int m_thread_get_sched(m_thread_t thread, m_thread_sched_t *sched);
+
+// set stack size and guard size (both rounded up to page size) of threads created afterwards
+// default: 256 KiB stack with a 4 KiB guard. stack memory is committed on first touch, so a large stack only costs
+// what the thread actually uses. overflowing the stack hits the guard and crashes instead of corrupting memory
+// guard_size 0 disables the guard, every guard costs a kernel memory mapping (see vm.max_map_count)
+// return -1 if size is less than 16 KiB
+int m_thread_set_stack(size_t size, size_t guard_size);
+
+// exit the calling thread with result, which is passed to m_thread_join()
+// returning from thread function is the same as m_thread_exit(NULL). it does nothing outside a thread
+void m_thread_exit(void *result);
+
+// wait for thread to finish, then store its result in result (if it is not NULL) and release it
+// the calling thread is parked while waiting. outside a thread (e.g., after m_thread_start() returns), it only joins a
+// finished thread
+// every thread shall be either joined or detached (m_thread_detach()), or its record (not its stack) leaks
+// return -1 with errno set: ESRCH if no such thread, EINVAL if it is detached or joined by another thread, EDEADLK if
+// thread is the calling thread, EBUSY if called outside a thread and thread has not finished
+int m_thread_join(m_thread_t thread, void **result);
+
+// detach thread, it is released when it finishes, and can't be joined anymore
+// return -1 with errno set: ESRCH if no such thread, EINVAL if it is detached or joined by another thread
+int m_thread_detach(m_thread_t thread);
+
 // give up the cpu in thread
 int m_thread_yield();
 
 // get current thread id, if it is not in the thread, return -1
 m_thread_t m_thread_self();
 
+// thread local storage, like pthread keys: each thread (or coroutine) has its own value of a key, NULL at first
+// __thread variables belong to the system thread, which runs many threads, and a thread may move between them
+#define M_THREAD_KEYS_MAX 32
+typedef unsigned int m_thread_key_t;
+
+// create a key, its value is NULL in every thread. when a thread exits with a non-NULL value of it, destructor (if
+// not NULL) is called with the value in the thread
+// return -1 with errno EAGAIN if M_THREAD_KEYS_MAX keys exist
+int m_thread_key_create(m_thread_key_t *key, void (*destructor)(void *));
+
+// delete a key, its destructor is not called for the values left
+// return -1 with errno EINVAL if no such key
+int m_thread_key_delete(m_thread_key_t key);
+
+// value of key in the calling thread, NULL outside a thread
+void *m_thread_getspecific(m_thread_key_t key);
+
+// set value of key in the calling thread
+// return -1 with errno set: EINVAL if no such key, EPERM if called outside a thread
+int m_thread_setspecific(m_thread_key_t key, const void *value);
+
+// result of a canceled thread, see m_thread_join()
+#define M_THREAD_CANCELED ((void *)-1)
+
+// cancel types, see m_thread_setcanceltype()
+// a canceled thread exits at its next cancellation point (default)
+#define M_THREAD_CANCEL_DEFERRED 0
+// a canceled thread exits at its next cancellation point, or as soon as it is preempted outside a critical section.
+// its stack is dropped, so it shall not hold locks or allocated memory then
+#define M_THREAD_CANCEL_ASYNCHRONOUS 1
+
+// request thread to exit with result M_THREAD_CANCELED, like pthread_cancel(). cancellation points are
+// m_thread_yield(), m_thread_sleep(), m_thread_usleep(), m_thread_testcancel(), the I/O functions when they wait, and
+// m_thread_offload(). a thread parked at one of them is woken up right away
+// a coroutine is finished next time it would run
+// return -1 with errno ESRCH if there is no such thread
+int m_thread_cancel(m_thread_t thread);
+
+// a cancellation point, exit if the calling thread has been canceled
+void m_thread_testcancel();
+
+// set cancel type of the calling thread, M_THREAD_CANCEL_DEFERRED or M_THREAD_CANCEL_ASYNCHRONOUS, the old one is
+// stored in oldtype if it is not NULL
+// return -1 with errno set: EINVAL if type is invalid, EPERM if called outside a thread
+int m_thread_setcanceltype(int type, int *oldtype);
+
+// cancel thread timeout_us microseconds later, as if m_thread_cancel() were called then. 0 clears its deadline
+// the timer interrupts a running thread when the deadline passes, so an asynchronous one is stopped on time
+// return -1 with errno set: ESRCH if there is no such thread, ENOMEM
+int m_thread_set_deadline(m_thread_t thread, unsigned long long timeout_us);
+
 // sleep sec seconds
 void m_thread_sleep(unsigned long long sec);
 
 // sleep us microseconds
 void m_thread_usleep(unsigned long long us);
 
+// I/O functions that park the calling thread instead of blocking the system thread
+// they work like their libc counterparts, except that fd is switched to non-blocking mode (and accepted fd is
+// non-blocking as well). the thread is parked until fd is ready, while other threads keep running
+// called outside a thread, they block the system thread
+ssize_t m_thread_read(int fd, void *buf, size_t count);
+ssize_t m_thread_write(int fd, const void *buf, size_t count);
+int m_thread_accept(int fd, struct sockaddr *addr, socklen_t *addrlen);
+int m_thread_connect(int fd, const struct sockaddr *addr, socklen_t addrlen);
+
+// call fn(arg) on a pool of system threads, for blocking calls epoll can't wait for (e.g. file I/O, getaddrinfo())
+// the calling thread is parked until it returns, while other threads keep running. errno is carried back
+// outside a thread (or in a coroutine), fn is called directly
+// return what fn returns
+void *m_thread_offload(void *(*fn)(void *), void *arg);
+
+// file I/O functions that park the calling thread until the request completes, they work like their libc counterparts
+// with m_thread_config_t.io_uring set, requests go through io_uring, and m_thread_read() / m_thread_write() on a
+// regular file (or block device) do so as well. otherwise pread() and pwrite() are called directly, and fsync() is
+// offloaded, see m_thread_offload()
+ssize_t m_thread_pread(int fd, void *buf, size_t count, off_t offset);
+ssize_t m_thread_pwrite(int fd, const void *buf, size_t count, off_t offset);
+int m_thread_fsync(int fd);
+
+// synchronization primitives for threads. a thread that has to wait is parked (removed from run queue), and woken
+// up directly by the one that releases it. they shall be used in threads: outside a thread, a call that would wait
+// fails with errno EBUSY instead
+
+// wait queue of parked threads, internal to m_thread
+typedef struct m_thread_queue_t {
+    struct TaskStruct_t *head;
+    struct TaskStruct_t *tail;
+    size_t size;
+} m_thread_queue_t;
+
+// mutex, waiters get it in FIFO order
+typedef struct m_mutex_t {
+    // spin lock protecting the fields below
+    _Atomic int lock;
+    int locked;
+    m_thread_queue_t waiters;
+} m_mutex_t;
+
+#define M_MUTEX_INITIALIZER {0}
+
+int m_mutex_init(m_mutex_t *mutex);
+int m_mutex_lock(m_mutex_t *mutex);
+// return -1 with errno EBUSY if mutex is locked
+int m_mutex_trylock(m_mutex_t *mutex);
+int m_mutex_unlock(m_mutex_t *mutex);
+
+// condition variable
+typedef struct m_cond_t {
+    _Atomic int lock;
+    m_thread_queue_t waiters;
+} m_cond_t;
+
+#define M_COND_INITIALIZER {0}
+
+int m_cond_init(m_cond_t *cond);
+// unlock mutex and wait for cond atomically, then lock mutex again. spurious wake up is possible, check the condition
+// in a loop
+int m_cond_wait(m_cond_t *cond, m_mutex_t *mutex);
+// wake up one waiter
+int m_cond_signal(m_cond_t *cond);
+// wake up all waiters
+int m_cond_broadcast(m_cond_t *cond);
+
+// counting semaphore
+typedef struct m_sem_t {
+    _Atomic int lock;
+    unsigned int value;
+    m_thread_queue_t waiters;
+} m_sem_t;
+
+#define M_SEM_INITIALIZER(value) {0, value}
+
+int m_sem_init(m_sem_t *sem, unsigned int value);
+int m_sem_wait(m_sem_t *sem);
+// return -1 with errno EAGAIN if value is 0
+int m_sem_trywait(m_sem_t *sem);
+int m_sem_post(m_sem_t *sem);
+
+// readers-writer lock. when released by a writer, all waiting readers get it, otherwise a waiting writer gets it. new
+// readers wait if a writer is waiting, so neither side starves
+typedef struct m_rwlock_t {
+    _Atomic int lock;
+    // number of readers holding it
+    unsigned int readers;
+    // a writer is holding it
+    int writer;
+    m_thread_queue_t read_waiters;
+    m_thread_queue_t write_waiters;
+} m_rwlock_t;
+
+#define M_RWLOCK_INITIALIZER {0}
+
+int m_rwlock_init(m_rwlock_t *rwlock);
+int m_rwlock_rdlock(m_rwlock_t *rwlock);
+int m_rwlock_wrlock(m_rwlock_t *rwlock);
+// release a read lock or the write lock
+int m_rwlock_unlock(m_rwlock_t *rwlock);
+
+// task group: threads spawned into it are waited for all at once, instead of joined one by one
+typedef struct m_task_group_t {
+    _Atomic int lock;
+    // number of threads spawned and not finished yet
+    unsigned long pending;
+    m_thread_queue_t waiters;
+} m_task_group_t;
+
+#define M_TASK_GROUP_INITIALIZER {0}
+
+int m_task_group_init(m_task_group_t *group);
+// create a detached thread running func(arg) in group. like m_thread_create(), a thread spawned by a thread starts on
+// the same worker, and idle workers steal it. threads of the group may spawn more into it
+int m_task_group_spawn(m_task_group_t *group, void (*func)(void *), void *arg);
+// wait until every thread spawned into group has finished (or been canceled)
+int m_task_group_wait(m_task_group_t *group);
+
+// call fn(chunk_begin, chunk_end, arg) for chunks of at most grain elements that cover [begin, end), and return when
+// all of them are done. chunks are taken one by one by the caller and a helper thread for every other worker, so a
+// busy worker takes fewer of them and each one takes neighbouring chunks. outside a thread, the caller runs them all
+// return -1 with errno EINVAL if grain is 0
+int m_parallel_for(size_t begin, size_t end, size_t grain, void (*fn)(size_t chunk_begin, size_t chunk_end, void *arg),
+                   void *arg);
+
+// bounded multi-producer multi-consumer channel of fixed size elements
+// a thread that has to wait is parked, and woken up directly by the one that completes its operation. elements are
+// handed over to a waiting receiver directly without going through the buffer
+typedef struct m_chan_t m_chan_t;
+
+// create a channel of elements of elem_size bytes, holding up to capacity of them (at least 1)
+// return NULL if out of memory or arguments are invalid
+m_chan_t *m_chan_create(size_t elem_size, size_t capacity);
+
+// destroy a channel, no thread shall be waiting on it
+void m_chan_destroy(m_chan_t *chan);
+
+// close a channel: senders fail from now on, receivers get the remaining elements then fail
+// threads waiting on it are woken up
+int m_chan_close(m_chan_t *chan);
+
+// copy an element into chan, wait if it is full
+// return -1 with errno EPIPE if chan is closed, EBUSY if it would wait outside a thread
+int m_chan_send(m_chan_t *chan, const void *elem);
+
+// take an element from chan into elem, wait if it is empty
+// return -1 with errno EPIPE if chan is closed and empty, EBUSY if it would wait outside a thread
+int m_chan_recv(m_chan_t *chan, void *elem);
+
+// send n elements from elems, taking the lock once for as many of them as possible
+// return the number of elements sent, less than n only if chan is closed (or it would wait outside a thread)
+size_t m_chan_send_batch(m_chan_t *chan, const void *elems, size_t n);
+
+// wait until chan has some elements, then take up to n of them into elems
+// return the number of elements received, 0 if chan is closed and empty (or it would wait outside a thread)
+size_t m_chan_recv_batch(m_chan_t *chan, void *elems, size_t n);
+
+#define M_CHAN_SEND 0
+#define M_CHAN_RECV 1
+
+// a channel operation for m_chan_select()
+typedef struct m_chan_case_t {
+    m_chan_t *chan;
+    // M_CHAN_SEND or M_CHAN_RECV
+    int op;
+    // element to send, or buffer to receive into
+    void *elem;
+    // set by m_chan_select() if the operation failed because chan is closed
+    int closed;
+} m_chan_case_t;
+
+// wait until one of the n operations in cases can complete, and complete it (only it)
+// if several of them are ready, one is chosen in round robin order
+// return its index, or -1 with errno EBUSY if it would wait outside a thread
+int m_chan_select(m_chan_case_t *cases, size_t n);
+
+// stackless coroutine: a step function the scheduler calls again and again on its own stack, until it returns
+// M_CO_DONE. it costs no stack, just a task struct, and runs in the same run queues as threads
+// it resumes where the last step left off by M_CO_BEGIN() / M_CO_END() around its body, which jump to the last
+// M_CO_YIELD() or M_CO_AWAIT(). local variables don't survive a step, keep the state in the struct of arg
+// a coroutine is never preempted, and can't be switched out in the middle of a step: functions that would park a
+// thread behave as they do outside a thread (e.g. m_mutex_lock() fails with EBUSY, m_thread_read() with EAGAIN)
+// example:
+//     int handler(void *arg) {
+//         struct conn *c = arg;
+//         M_CO_BEGIN(&c->co);
+//         while ((c->n = m_thread_read(c->fd, c->buf, sizeof(c->buf))) < 0 && errno == EAGAIN) {
+//             M_CO_AWAIT(&c->co, m_co_wait_read(c->fd));
+//         }
+//         M_CO_END(&c->co);
+//     }
+
+// where a coroutine resumes, zero initialized before it starts
+typedef struct m_co_t {
+    int line;
+} m_co_t;
+
+// return values of a step
+// finished, like a returned thread
+#define M_CO_DONE 0
+// run again later, like m_thread_yield()
+#define M_CO_READY 1
+// parked by a m_co_wait_*() call (or m_co_sleep()), run again when it is woken up
+#define M_CO_WAIT 2
+
+// they expand to a switch statement with a case per yield, so the body can't yield inside another switch statement,
+// and can't have two of them on the same line
+#define M_CO_BEGIN(co) switch ((co)->line) { case 0:
+#define M_CO_END(co) } return M_CO_DONE
+#define M_CO_YIELD(co) do { (co)->line = __LINE__; return M_CO_READY; case __LINE__:; } while (0)
+// wait is a m_co_wait_*() call, the coroutine parks if it succeeds, or goes on if it fails
+#define M_CO_AWAIT(co, wait) do { (co)->line = __LINE__; if ((wait) == 0) return M_CO_WAIT; case __LINE__:; } while (0)
+
+// create a coroutine that runs step(arg), its id is a thread id, so it can be joined or detached like a thread
+int m_co_create(m_thread_t *ret, int (*step)(void *), void *arg);
+
+// park the calling coroutine for us microseconds once its step returns M_CO_WAIT, for M_CO_AWAIT()
+// return -1 with errno EINVAL if not called in a coroutine
+int m_co_sleep(unsigned long long us);
+
+// park the calling coroutine until fd is readable / writable once its step returns M_CO_WAIT, for M_CO_AWAIT()
+// return -1 with errno set if fd can't be waited, or EINVAL if not called in a coroutine
+int m_co_wait_read(int fd);
+int m_co_wait_write(int fd);
+
 // start all the threads created before, block until everything finish
+// all the threads run on the calling system thread (M:1)
 int m_thread_start();
 
+// scheduling policies, selected by m_thread_config_t.policy. with multiple workers, each worker orders its own run
+// queue by the policy, and idle workers steal from busy ones
+// round robin: threads run in FIFO order
+#define M_SCHED_RR 0
+// strict priority: a thread runs only if no thread of higher priority is runnable, FIFO among the same priority
+#define M_SCHED_PRIORITY 1
+// fair share: cpu time is shared in proportion to weight, the thread that has run least (weighted) runs first
+#define M_SCHED_FAIR 2
+
+// scheduler configuration for m_thread_start_config()
+typedef struct m_thread_config_t {
+    // number of system threads (workers) running the threads, 0 means one per online cpu core
+    unsigned int workers;
+    // M_SCHED_RR (default), M_SCHED_PRIORITY or M_SCHED_FAIR
+    int policy;
+    // time slice of threads in microseconds, 0 means 10ms
+    unsigned int quantum_us;
+    // non-zero: measure cpu time and run queue wait time of threads, see m_thread_stats_t
+    int stats;
+    // number of trace events kept by each worker, 0 disables tracing, see m_thread_trace_export()
+    unsigned int trace_size;
+    // number of system threads running m_thread_offload() calls, 0 means 4
+    unsigned int offload_threads;
+    // non-zero: submit file I/O to io_uring, batched by each worker. ignored if the kernel doesn't support it
+    int io_uring;
+} m_thread_config_t;
+
+// like m_thread_start(), but threads run on config->workers system threads (M:N), the calling system thread is one
+// of them. each worker has its own run queue, idle workers steal threads from busy ones
+// threads may run in parallel, shared data must be protected by user
+int m_thread_start_config(const m_thread_config_t *config);
+
+// runtime statistics of a thread
+typedef struct m_thread_stats_t {
+    // number of times it is switched in
+    uint64_t switches;
+    // number of times it is switched out by timer interrupt
+    uint64_t preemptions;
+    // number of times it gives up the cpu by m_thread_yield()
+    uint64_t yields;
+    // number of times it waits for something (join, lock, channel, sleep, I/O...)
+    uint64_t parks;
+    // time in ns it has run, and waited in run queues. only measured if m_thread_config_t.stats or trace_size is set
+    uint64_t cpu_time_ns;
+    uint64_t wait_time_ns;
+} m_thread_stats_t;
+
+// get runtime statistics of thread, until it is joined or its detached self returns
+// return -1 with errno ESRCH if no such thread
+int m_thread_stats(m_thread_t thread, m_thread_stats_t *stats);
+
+// write the time slices recorded by the workers (the last m_thread_config_t.trace_size of each) to out as JSON in
+// Chrome trace event format, which chrome://tracing and Perfetto open. a worker is shown as a thread there
+// call it after m_thread_start_config() returns, the trace is kept until the next start
+// return -1 with errno ENOENT if nothing was traced
+int m_thread_trace_export(FILE *out);
+
+// a scheduler: workers with their own run queues, timers, I/O reactor, deadlines and offload pool. schedulers share
+// only thread ids, stacks and thread local storage keys, so several of them can run at the same time, each started on
+// its own system thread. threads of different schedulers may still join, lock, signal and send to each other
+// m_thread_start() and m_thread_start_config() run the default scheduler
+typedef struct m_sched_t m_sched_t;
+
+// create a scheduler, return NULL with errno ENOMEM if it can't be allocated
+m_sched_t *m_sched_create();
+
+// free a scheduler created by m_sched_create()
+// return -1 with errno EBUSY if it is running or has threads not finished, or EINVAL if it is the default scheduler
+int m_sched_destroy(m_sched_t *sched);
+
+// like m_thread_create(), but the thread runs on sched
+int m_sched_thread_create(m_sched_t *sched, m_thread_t *ret, void (*func)(void *), void *arg);
+
+// like m_thread_start_config(), but runs the threads of sched. the calling system thread is its worker 0
+// return -1 with errno EBUSY if sched is already running
+int m_sched_start(m_sched_t *sched, const m_thread_config_t *config);
+
+// scheduler of the calling thread, or the default scheduler outside threads
+m_sched_t *m_sched_self();
+
+// like m_thread_trace_export(), for the last run of sched
+int m_sched_trace_export(m_sched_t *sched, FILE *out);
+
+// disable preemption of the calling thread, calls can be nested
+// a timer interrupt that arrives in between is deferred until the outermost m_thread_preempt_enable()
+// no system call is made, they do nothing outside a thread
+void m_thread_preempt_disable();
+
+// enable preemption of the calling thread, yield if a timer interrupt was deferred
+void m_thread_preempt_enable();
+
+// printf() for threads: the message is formatted with preemption disabled, and buffered by the worker, which writes
+// it to stdout when the buffer is full, a thread is preempted, the worker is idle or exits, or m_thread_log_flush() is
+// called. it never calls malloc(), and never blocks on the lock of stdout held by a preempted thread
+// messages longer than 1023 bytes are cut. outside a thread, the message is written at once
+// return the length of the message, or -1 if it can't be formatted
+int m_thread_log(const char *format, ...) __attribute__((format(printf, 1, 2)));
+
+// write the buffered messages of the calling thread's worker
+void m_thread_log_flush();
+
 // make an expression `x` async signal safe by making it uninterruptible
 // example: async_signal_safe(x++;y++;);
 // trick: make all function calls to a specific function safe:
     // #define your_function(...) async_signal_safe(your_function(__VA_ARGS__))
     // e.g., printf:
     // #define printf(...) async_signal_safe(printf(__VA_ARGS__))
+// x shall not leave the block by return, goto or longjmp
 #define async_signal_safe(x) do {   \
-    void blockInterrupt();   \
-    void unblockInterrupt(); \
-    blockInterrupt();   \
+    m_thread_preempt_disable();   \
     x;  \
-    unblockInterrupt(); \
+    m_thread_preempt_enable(); \
 } while (0)
 
 #endif
\ No newline at end of file
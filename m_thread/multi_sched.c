@@ -0,0 +1,78 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <pthread.h>
+#include "m_thread.h"
+
+#define PRODUCERS 4
+#define ITEMS 100000
+
+// producers run on one scheduler, consumers on another, the channel is the only thing they share
+static m_chan_t *chan;
+static uint64_t sums[PRODUCERS];
+
+static void produce(void *arg) {
+    for (uint64_t i = 1; i <= ITEMS; i++) {
+        m_chan_send(chan, &i);
+    }
+}
+
+// waits for the producers of the other scheduler, then closes the channel
+static void closer(void *arg) {
+    m_thread_t *producers = arg;
+    for (int i = 0; i < PRODUCERS; i++) {
+        m_thread_join(producers[i], NULL);
+    }
+    m_chan_close(chan);
+}
+
+static void consume(void *arg) {
+    uint64_t *sum = arg;
+    uint64_t value;
+    while (!m_chan_recv(chan, &value)) {
+        *sum += value;
+    }
+}
+
+// each scheduler is run by its own system thread, its workers are started from there
+static void *runSched(void *arg) {
+    m_thread_config_t config = {.workers = 2};
+    m_sched_start(arg, &config);
+    return NULL;
+}
+
+int main() {
+    chan = m_chan_create(sizeof(uint64_t), 64);
+    m_sched_t *producer_sched = m_sched_create();
+    m_sched_t *consumer_sched = m_sched_create();
+    if (!chan || !producer_sched || !consumer_sched) {
+        printf("create failed\n");
+        return 1;
+    }
+
+    m_thread_t producers[PRODUCERS], t;
+    for (int i = 0; i < PRODUCERS; i++) {
+        m_sched_thread_create(producer_sched, &producers[i], produce, NULL);
+        m_sched_thread_create(consumer_sched, &t, consume, &sums[i]);
+        m_thread_detach(t);
+    }
+    m_sched_thread_create(consumer_sched, &t, closer, producers);
+    m_thread_detach(t);
+
+    pthread_t threads[2];
+    pthread_create(&threads[0], NULL, runSched, producer_sched);
+    pthread_create(&threads[1], NULL, runSched, consumer_sched);
+    pthread_join(threads[0], NULL);
+    pthread_join(threads[1], NULL);
+
+    uint64_t total = 0;
+    for (int i = 0; i < PRODUCERS; i++) {
+        total += sums[i];
+    }
+    printf("sum %llu, expected %llu\n", (unsigned long long)total,
+           (unsigned long long)PRODUCERS * ITEMS * (ITEMS + 1) / 2);
+
+    m_sched_destroy(producer_sched);
+    m_sched_destroy(consumer_sched);
+    m_chan_destroy(chan);
+    return 0;
+}
@@ -0,0 +1,100 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <time.h>
+#include "m_thread.h"
+
+// fill an array and sum it up with m_parallel_for(), then count primes in ranges with a task group
+
+#define N 50000000
+#define GRAIN 100000
+#define PRIME_RANGES 64
+#define PRIME_RANGE_SIZE 20000
+
+static uint32_t *values;
+static uint64_t sum;
+
+struct prime_range {
+    uint32_t begin;
+    uint32_t end;
+    int count;
+};
+
+static struct prime_range ranges[PRIME_RANGES];
+
+static double now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+void fill(size_t begin, size_t end, void *arg) {
+    for (size_t i = begin; i < end; i++) {
+        values[i] = (uint32_t)(i * 2654435761u) >> 8;
+    }
+}
+
+void add(size_t begin, size_t end, void *arg) {
+    uint64_t partial = 0;
+    for (size_t i = begin; i < end; i++) {
+        partial += values[i];
+    }
+    __atomic_add_fetch(&sum, partial, __ATOMIC_RELAXED);
+}
+
+void countPrimes(void *arg) {
+    struct prime_range *range = arg;
+    for (uint32_t n = range->begin; n < range->end; n++) {
+        int prime = n >= 2;
+        for (uint32_t d = 2; d * d <= n && prime; d++) {
+            prime = n % d != 0;
+        }
+        range->count += prime;
+    }
+}
+
+void root(void *arg) {
+    double start = now();
+    m_parallel_for(0, N, GRAIN, fill, NULL);
+    m_parallel_for(0, N, GRAIN, add, NULL);
+    m_thread_log("parallel for: sum %llu in %.3fs\n", (unsigned long long)sum, now() - start);
+
+    start = now();
+    m_task_group_t group = M_TASK_GROUP_INITIALIZER;
+    for (int i = 0; i < PRIME_RANGES; i++) {
+        ranges[i].begin = i * PRIME_RANGE_SIZE * 16;
+        ranges[i].end = ranges[i].begin + PRIME_RANGE_SIZE;
+        if (m_task_group_spawn(&group, countPrimes, &ranges[i])) {
+            m_thread_log("spawn failed\n");
+            break;
+        }
+    }
+    // the thread is parked until every task of the group finishes
+    m_task_group_wait(&group);
+    int total = 0;
+    for (int i = 0; i < PRIME_RANGES; i++) {
+        total += ranges[i].count;
+    }
+    m_thread_log("task group: %d primes in %.3fs\n", total, now() - start);
+}
+
+int main(int argc, char **argv) {
+    values = malloc(N * sizeof(uint32_t));
+    if (!values) {
+        return 1;
+    }
+    unsigned int workers = argc > 1 ? atoi(argv[1]) : 0;
+    m_thread_t t;
+    m_thread_create(&t, root, NULL);
+    m_thread_config_t config = {.workers = workers};
+    m_thread_start_config(&config);
+
+    // check against a serial run
+    uint64_t expected = 0;
+    for (size_t i = 0; i < N; i++) {
+        expected += (uint32_t)(i * 2654435761u) >> 8;
+    }
+    printf("expected sum %llu\n", (unsigned long long)expected);
+    free(values);
+    return sum != expected;
+}
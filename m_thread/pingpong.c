@@ -2,8 +2,6 @@
 #include <unistd.h>
 #include "m_thread.h"
 
-#define printf(...) async_signal_safe(printf(__VA_ARGS__))
-
 #define PINGPONG_ROUND 3
 
 struct fds {
@@ -17,13 +15,13 @@ void write_read(void *arg) {
     int count = 0;
     while (count < PINGPONG_ROUND) {
 
-        printf("Thread %lu: --> %c\n", m_thread_self(), buf);
-        write(fds->write, &buf, 1);
+        m_thread_log("Thread %lu: --> %c\n", m_thread_self(), buf);
+        m_thread_write(fds->write, &buf, 1);
 
-        read(fds->read, &buf, 1);
-        printf("Thread %lu: <-- %c\n", m_thread_self(), buf);
+        m_thread_read(fds->read, &buf, 1);
+        m_thread_log("Thread %lu: <-- %c\n", m_thread_self(), buf);
 
-        printf("Thread %lu: %c++ => %c\n", m_thread_self(), buf, buf + 1);
+        m_thread_log("Thread %lu: %c++ => %c\n", m_thread_self(), buf, buf + 1);
         buf++;
 
         count++;
@@ -36,14 +34,14 @@ void read_write(void *arg) {
     int count = 0;
     while (count < PINGPONG_ROUND) {
 
-        read(fds->read, &buf, 1);
-        printf("Thread %lu: <-- %c\n", m_thread_self(), buf);
+        m_thread_read(fds->read, &buf, 1);
+        m_thread_log("Thread %lu: <-- %c\n", m_thread_self(), buf);
 
-        printf("Thread %lu: %c++ => %c\n", m_thread_self(), buf, buf + 1);
+        m_thread_log("Thread %lu: %c++ => %c\n", m_thread_self(), buf, buf + 1);
         buf++;
 
-        printf("Thread %lu: --> %c\n", m_thread_self(), buf);
-        write(fds->write, &buf, 1);
+        m_thread_log("Thread %lu: --> %c\n", m_thread_self(), buf);
+        m_thread_write(fds->write, &buf, 1);
 
         count++;
     }
@@ -0,0 +1,36 @@
+#include <stdio.h>
+#include <time.h>
+#include "m_thread.h"
+
+// measure the cost of m_thread_yield() with two threads passing the turn to each other
+
+#define ROUNDS 1000000
+
+static volatile int turn;
+static struct timespec start, end;
+
+void player(void *arg) {
+    int me = (int)(long)arg;
+    for (int i = 0; i < ROUNDS; i++) {
+        // wait for my turn, then pass it to the other one
+        while (turn != me) {
+            m_thread_yield();
+        }
+        turn = !me;
+    }
+}
+
+int main() {
+    m_thread_t t1, t2;
+    m_thread_create(&t1, player, (void *)0);
+    m_thread_create(&t2, player, (void *)1);
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    m_thread_start();
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    double ns = (end.tv_sec - start.tv_sec) * 1e9 + (end.tv_nsec - start.tv_nsec);
+    // each round trip takes two yields
+    printf("%d round trips in %.3f ms, %.1f ns per yield\n", ROUNDS, ns / 1e6, ns / ROUNDS / 2);
+    return 0;
+}
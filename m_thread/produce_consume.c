@@ -4,73 +4,64 @@
 
 #include "m_thread.h"
 
-#define printf(...) async_signal_safe(printf(__VA_ARGS__))
-#define free(...) async_signal_safe(free(__VA_ARGS__))
-
 #define N_PRODUCER 2
 #define N_CONSUMER 20
 
-struct WriteFds {
+struct Channels {
     size_t n;
-    int *fds;
+    m_chan_t **chans;
 };
 
 void producer(void *arg) {
-    struct WriteFds *fds = arg;
+    struct Channels *chans = arg;
     while (1) {
-        size_t idx = (size_t)random() % fds->n;
+        size_t idx = (size_t)random() % chans->n;
         long int random_product = random();
-        printf("[P] give idx %llu with %ld\n", idx, random_product);
-        write(fds->fds[idx], &random_product, sizeof(random_product));
+        m_thread_log("[P] give idx %llu with %ld\n", idx, random_product);
+        m_chan_send(chans->chans[idx], &random_product);
         m_thread_sleep(random() % 5 + 2);
     }
 }
 
 void consumer(void *arg) {
-    int fd = *(int *)arg;
-    free(arg);
+    m_chan_t *chan = arg;
     while (1) {
         long int random_product;
-        read(fd, &random_product, sizeof(random_product));
-        printf("[Thread %2lld] got stuff %ld\n", m_thread_self(), random_product);
+        m_chan_recv(chan, &random_product);
+        m_thread_log("[Thread %2lld] got stuff %ld\n", m_thread_self(), random_product);
     }
 }
 
-int createConsumer() {
-    int fds[2];
-    if (pipe(fds)) {
-        return -1;
-    }
-    int *r = malloc(sizeof(int));
-    if (!r) {
-        return -1;
+m_chan_t *createConsumer() {
+    m_chan_t *chan = m_chan_create(sizeof(long int), 1);
+    if (!chan) {
+        return NULL;
     }
-    *r = fds[0];
     m_thread_t t;
-    m_thread_create(&t, consumer, r);
-    return fds[1];
+    m_thread_create(&t, consumer, chan);
+    return chan;
 }
 
-void createProducer(struct WriteFds *fds) {
+void createProducer(struct Channels *chans) {
     m_thread_t t;
-    m_thread_create(&t, producer, fds);
+    m_thread_create(&t, producer, chans);
 }
 
 int main() {
-    int buf[N_CONSUMER];
-    struct WriteFds fds;
-    fds.n = N_CONSUMER;
-    fds.fds = buf;
+    m_chan_t *buf[N_CONSUMER];
+    struct Channels chans;
+    chans.n = N_CONSUMER;
+    chans.chans = buf;
 
     for (int i = 0; i < N_CONSUMER; i++) {
-        int feedFd;
-        if ((feedFd = createConsumer()) == -1) {
+        m_chan_t *feed;
+        if (!(feed = createConsumer())) {
             return -1;
         }
-        fds.fds[i] = feedFd;
+        chans.chans[i] = feed;
     }
     for (int i = 0; i < N_PRODUCER; i++) {
-        createProducer(&fds);
+        createProducer(&chans);
     }
 
     m_thread_start();
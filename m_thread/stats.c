@@ -0,0 +1,58 @@
+#include <stdio.h>
+#include "m_thread.h"
+
+// find out which thread hogs the cpu: a spinner, a polite one that yields, and a sleeper share one worker
+// their statistics are printed, and their time slices are written to trace.json (open it in chrome://tracing)
+
+#define N 3
+
+static const char *const names[N] = {"spinner", "yielder", "sleeper"};
+static volatile int done;
+
+void spinner(void *arg) {
+    while (!done) {
+    }
+}
+
+void yielder(void *arg) {
+    for (int i = 0; i < 100000; i++) {
+        m_thread_yield();
+    }
+}
+
+void sleeper(void *arg) {
+    for (int i = 0; i < 20; i++) {
+        m_thread_usleep(10000);
+    }
+    done = 1;
+}
+
+int main() {
+    m_thread_t threads[N];
+    m_thread_create(&threads[0], spinner, NULL);
+    m_thread_create(&threads[1], yielder, NULL);
+    m_thread_create(&threads[2], sleeper, NULL);
+
+    m_thread_config_t config = {.workers = 1, .quantum_us = 1000, .stats = 1, .trace_size = 100000};
+    m_thread_start_config(&config);
+
+    printf("%-8s %10s %10s %10s %10s %12s %12s\n", "thread", "switches", "preempted", "yields", "parks", "cpu ms",
+           "wait ms");
+    for (int i = 0; i < N; i++) {
+        m_thread_stats_t stats;
+        m_thread_stats(threads[i], &stats);
+        printf("%-8s %10llu %10llu %10llu %10llu %12.3f %12.3f\n", names[i], (unsigned long long)stats.switches,
+               (unsigned long long)stats.preemptions, (unsigned long long)stats.yields,
+               (unsigned long long)stats.parks, stats.cpu_time_ns / 1e6, stats.wait_time_ns / 1e6);
+        m_thread_join(threads[i], NULL);
+    }
+
+    FILE *out = fopen("trace.json", "w");
+    if (!out || m_thread_trace_export(out)) {
+        perror("export trace failed");
+        return 1;
+    }
+    fclose(out);
+    printf("trace written to trace.json\n");
+    return 0;
+}